@@ -31,6 +31,7 @@ LOCAL_SRC_FILES := \
 	mediatek.c \
 	nouveau.c \
 	rockchip.c \
+	sw.c \
 	tegra.c \
 	udl.c \
 	vc4.c \
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <xf86drm.h>
 
 #include "addrinterface.h"
@@ -415,6 +416,59 @@ static void *amdgpu_bo_map(struct bo *bo, struct map_info *data, size_t plane, u
 		    gem_map.out.addr_ptr);
 }
 
+/* Sets *busy if the buffer is still busy at timeout, in nanoseconds on the monotonic clock. */
+static int amdgpu_bo_wait_until(struct bo *bo, uint64_t timeout, bool *busy)
+{
+	int ret;
+	union drm_amdgpu_gem_wait_idle wait_idle;
+
+	memset(&wait_idle, 0, sizeof(wait_idle));
+	wait_idle.in.handle = bo->handles[0].u32;
+	wait_idle.in.timeout = timeout;
+
+	ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_WAIT_IDLE, &wait_idle,
+				  sizeof(wait_idle));
+	if (ret) {
+		fprintf(stderr, "drv: DRM_IOCTL_AMDGPU_GEM_WAIT_IDLE failed with %d\n", ret);
+		return ret;
+	}
+
+	*busy = wait_idle.out.status;
+	return 0;
+}
+
+static int amdgpu_bo_wait(struct bo *bo, uint32_t map_flags, int timeout_ms)
+{
+	int ret;
+	bool busy;
+	uint64_t timeout;
+	struct timespec now;
+
+	/* A timeout in the past only checks whether the buffer is busy. */
+	ret = amdgpu_bo_wait_until(bo, 0, &busy);
+	if (ret)
+		return ret;
+
+	if (!busy)
+		return 1;
+
+	if (!timeout_ms)
+		return -ETIME;
+
+	timeout = AMDGPU_TIMEOUT_INFINITE;
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+		timeout += (uint64_t)timeout_ms * 1000000;
+	}
+
+	ret = amdgpu_bo_wait_until(bo, timeout, &busy);
+	if (ret)
+		return ret;
+
+	return busy ? -ETIME : 0;
+}
+
 static uint32_t amdgpu_resolve_format(uint32_t format, uint64_t use_flags)
 {
 	switch (format) {
@@ -427,6 +481,7 @@ static uint32_t amdgpu_resolve_format(uint32_t format, uint64_t use_flags)
 
 struct backend backend_amdgpu = {
 	.name = "amdgpu",
+	.flags = BACKEND_MAP_DMA_BUF | BACKEND_INVALIDATE_SKIP_IDLE,
 	.init = amdgpu_init,
 	.close = amdgpu_close,
 	.bo_create = amdgpu_bo_create,
@@ -434,6 +489,9 @@ struct backend backend_amdgpu = {
 	.bo_import = drv_prime_bo_import,
 	.bo_map = amdgpu_bo_map,
 	.bo_unmap = drv_bo_munmap,
+	.bo_wait = amdgpu_bo_wait,
+	.bo_invalidate = drv_dma_buf_invalidate,
+	.bo_flush = drv_dma_buf_flush,
 	.resolve_format = amdgpu_resolve_format,
 };
 
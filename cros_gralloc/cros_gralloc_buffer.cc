@@ -22,10 +22,12 @@ cros_gralloc_buffer::cros_gralloc_buffer(uint32_t id, struct bo *acquire_bo,
 
 cros_gralloc_buffer::~cros_gralloc_buffer()
 {
+	struct driver *drv = drv_bo_get_driver(bo_);
+
 	drv_bo_destroy(bo_);
 	if (hnd_) {
 		native_handle_close(&hnd_->base);
-		delete hnd_;
+		drv_object_free(drv, hnd_, sizeof(*hnd_));
 	}
 }
 
@@ -45,7 +47,12 @@ int32_t cros_gralloc_buffer::decrease_refcount()
 	return --refcount_;
 }
 
-int32_t cros_gralloc_buffer::lock(uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
+/*
+ * Waits at most timeout_ms for the GPU to finish with the buffer, or as long as needed if it is
+ * negative. Fails with -EBUSY for a zero timeout and -ETIME otherwise.
+ */
+int32_t cros_gralloc_buffer::lock(uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES],
+				  int32_t timeout_ms)
 {
 	void *vaddr = nullptr;
 
@@ -61,6 +68,13 @@ int32_t cros_gralloc_buffer::lock(uint32_t map_flags, uint8_t *addr[DRV_MAX_PLAN
 	}
 
 	if (map_flags) {
+		/* Without a timeout, drv_bo_invalidate() waits for the GPU. */
+		if (timeout_ms >= 0) {
+			int32_t ret = drv_bo_wait_idle(bo_, map_flags, timeout_ms);
+			if (ret < 0)
+				return (ret == -ETIME && !timeout_ms) ? -EBUSY : ret;
+		}
+
 		if (lock_data_[0]) {
 			drv_bo_invalidate(bo_, lock_data_[0]);
 			vaddr = lock_data_[0]->addr;
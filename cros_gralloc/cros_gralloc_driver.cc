@@ -12,7 +12,9 @@
 #include <cstdlib>
 #include <errno.h>
 #include <fcntl.h>
+#include <new>
 #include <unistd.h>
+#include <vector>
 #include <xf86drm.h>
 
 cros_gralloc_driver::cros_gralloc_driver() : drv_(nullptr)
@@ -93,16 +95,10 @@ bool cros_gralloc_driver::is_supported(const struct cros_gralloc_buffer_descript
 	return (combo != nullptr);
 }
 
-int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
-				      buffer_handle_t *out_handle)
+struct bo *cros_gralloc_driver::create_bo(const struct cros_gralloc_buffer_descriptor *descriptor)
 {
-	uint32_t id;
-	uint64_t mod;
-	size_t num_planes;
-	uint32_t resolved_format;
-
 	struct bo *bo;
-	struct cros_gralloc_handle *hnd;
+	uint32_t resolved_format;
 
 	resolved_format = drv_resolve_format(drv_, descriptor->drm_format, descriptor->use_flags);
 	if (descriptor->modifier == 0) {
@@ -112,10 +108,19 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 		bo = drv_bo_create_with_modifiers(drv_, descriptor->width, descriptor->height,
 						  resolved_format, &descriptor->modifier, 1);
 	}
-	if (!bo) {
+	if (!bo)
 		cros_gralloc_error("Failed to create bo.");
-		return -ENOMEM;
-	}
+
+	return bo;
+}
+
+cros_gralloc_handle *
+cros_gralloc_driver::create_handle(const struct cros_gralloc_buffer_descriptor *descriptor,
+				   struct bo *bo)
+{
+	uint64_t mod;
+	size_t num_planes;
+	struct cros_gralloc_handle *hnd;
 
 	/*
 	 * If there is a desire for more than one kernel buffer, this can be
@@ -123,12 +128,15 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	 * send more than one fd. GL/Vulkan drivers may also have to modified.
 	 */
 	if (drv_num_buffers_per_bo(bo) != 1) {
-		drv_bo_destroy(bo);
 		cros_gralloc_error("Can only support one buffer per bo.");
-		return -EINVAL;
+		return nullptr;
 	}
 
-	hnd = new cros_gralloc_handle();
+	void *mem = drv_object_alloc(drv_, sizeof(*hnd));
+	if (!mem)
+		return nullptr;
+
+	hnd = new (mem) cros_gralloc_handle();
 	num_planes = drv_bo_get_num_planes(bo);
 
 	hnd->base.version = sizeof(hnd->base);
@@ -163,8 +171,56 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	hnd->producer_usage = descriptor->producer_usage;
 	hnd->consumer_usage = descriptor->consumer_usage;
 
+	return hnd;
+}
+
+void cros_gralloc_driver::destroy_handle(cros_gralloc_handle *hnd)
+{
+	native_handle_close(&hnd->base);
+	drv_object_free(drv_, hnd, sizeof(*hnd));
+}
+
+/* Buffers live in the driver's object slabs; the buffer takes ownership of bo and hnd. */
+cros_gralloc_buffer *cros_gralloc_driver::create_buffer(uint32_t id, struct bo *bo,
+							cros_gralloc_handle *hnd)
+{
+	void *mem = drv_object_alloc(drv_, sizeof(cros_gralloc_buffer));
+	if (!mem)
+		return nullptr;
+
+	return new (mem) cros_gralloc_buffer(id, bo, hnd);
+}
+
+void cros_gralloc_driver::destroy_buffer(cros_gralloc_buffer *buffer)
+{
+	buffer->~cros_gralloc_buffer();
+	drv_object_free(drv_, buffer, sizeof(*buffer));
+}
+
+int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
+				      buffer_handle_t *out_handle)
+{
+	uint32_t id;
+	struct bo *bo;
+	struct cros_gralloc_handle *hnd;
+
+	bo = create_bo(descriptor);
+	if (!bo)
+		return -ENOMEM;
+
+	hnd = create_handle(descriptor, bo);
+	if (!hnd) {
+		drv_bo_destroy(bo);
+		return -EINVAL;
+	}
+
 	id = drv_bo_get_plane_handle(bo, 0).u32;
-	auto buffer = new cros_gralloc_buffer(id, bo, hnd);
+	auto buffer = create_buffer(id, bo, hnd);
+	if (!buffer) {
+		destroy_handle(hnd);
+		drv_bo_destroy(bo);
+		return -ENOMEM;
+	}
 
 	SCOPED_SPIN_LOCK(mutex_);
 	buffers_.emplace(id, buffer);
@@ -173,6 +229,96 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	return 0;
 }
 
+/*
+ * Allocates |count| buffers at once. Plain descriptors go through
+ * drv_bo_create_batch() so the driver lock is taken once for the whole set, and
+ * the buffer tables are only locked once at the end. Either every handle is
+ * returned or none are.
+ */
+int32_t
+cros_gralloc_driver::allocate_batch(const struct cros_gralloc_buffer_descriptor *const *descriptors,
+				    uint32_t count, buffer_handle_t *out_handles)
+{
+	int32_t ret = 0;
+	uint32_t i, created = 0;
+	bool use_batch = true;
+	std::vector<struct bo *> bos(count, nullptr);
+	std::vector<struct drv_bo_descriptor> drv_descriptors(count);
+	std::vector<cros_gralloc_handle *> hnds(count, nullptr);
+	std::vector<cros_gralloc_buffer *> buffers(count, nullptr);
+
+	for (i = 0; i < count; i++) {
+		drv_descriptors[i].width = descriptors[i]->width;
+		drv_descriptors[i].height = descriptors[i]->height;
+		drv_descriptors[i].format = drv_resolve_format(drv_, descriptors[i]->drm_format,
+							       descriptors[i]->use_flags);
+		drv_descriptors[i].use_flags = descriptors[i]->use_flags;
+		if (descriptors[i]->modifier != 0)
+			use_batch = false;
+	}
+
+	if (use_batch) {
+		if (drv_bo_create_batch(drv_, drv_descriptors.data(), count, bos.data())) {
+			cros_gralloc_error("Failed to create bo batch.");
+			return -ENOMEM;
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			bos[i] = create_bo(descriptors[i]);
+			if (!bos[i]) {
+				ret = -ENOMEM;
+				goto destroy_bos;
+			}
+		}
+	}
+
+	for (created = 0; created < count; created++) {
+		hnds[created] = create_handle(descriptors[created], bos[created]);
+		if (!hnds[created]) {
+			ret = -EINVAL;
+			goto destroy_handles;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		uint32_t id = drv_bo_get_plane_handle(bos[i], 0).u32;
+		buffers[i] = create_buffer(id, bos[i], hnds[i]);
+		if (!buffers[i]) {
+			ret = -ENOMEM;
+			goto destroy_buffers;
+		}
+	}
+
+	{
+		SCOPED_SPIN_LOCK(mutex_);
+		for (i = 0; i < count; i++) {
+			buffers_.emplace(buffers[i]->get_id(), buffers[i]);
+			handles_.emplace(hnds[i], std::make_pair(buffers[i], 1));
+			out_handles[i] = &hnds[i]->base;
+		}
+	}
+
+	return 0;
+
+destroy_buffers:
+	/* Buffers own their bo and handle. */
+	while (i--) {
+		destroy_buffer(buffers[i]);
+		bos[i] = nullptr;
+		hnds[i] = nullptr;
+	}
+destroy_handles:
+	while (created--)
+		if (hnds[created])
+			destroy_handle(hnds[created]);
+destroy_bos:
+	for (i = 0; i < count; i++)
+		if (bos[i])
+			drv_bo_destroy(bos[i]);
+
+	return ret;
+}
+
 int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 {
 	uint32_t id;
@@ -223,7 +369,12 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 
 		id = drv_bo_get_plane_handle(bo, 0).u32;
 
-		buffer = new cros_gralloc_buffer(id, bo, nullptr);
+		buffer = create_buffer(id, bo, nullptr);
+		if (!buffer) {
+			drv_bo_destroy(bo);
+			return -ENOMEM;
+		}
+
 		buffers_.emplace(id, buffer);
 	}
 
@@ -260,14 +411,15 @@ int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 
 	if (buffer->decrease_refcount() == 0) {
 		buffers_.erase(buffer->get_id());
-		delete buffer;
+		destroy_buffer(buffer);
 	}
 
 	return 0;
 }
 
+/* timeout_ms only limits the wait for implicit GPU work; the acquire fence is always waited on. */
 int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence, uint32_t map_flags,
-				  uint8_t *addr[DRV_MAX_PLANES])
+				  uint8_t *addr[DRV_MAX_PLANES], int32_t timeout_ms)
 {
 	int32_t ret = cros_gralloc_sync_wait(acquire_fence);
 	if (ret)
@@ -286,7 +438,7 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 		return -EINVAL;
 	}
 
-	return buffer->lock(map_flags, addr);
+	return buffer->lock(map_flags, addr, timeout_ms);
 }
 
 int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fence)
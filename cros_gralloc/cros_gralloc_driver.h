@@ -23,12 +23,14 @@ class cros_gralloc_driver
 	bool is_supported(const struct cros_gralloc_buffer_descriptor *descriptor);
 	int32_t allocate(const struct cros_gralloc_buffer_descriptor *descriptor,
 			 buffer_handle_t *out_handle);
+	int32_t allocate_batch(const struct cros_gralloc_buffer_descriptor *const *descriptors,
+			       uint32_t count, buffer_handle_t *out_handles);
 
 	int32_t retain(buffer_handle_t handle);
 	int32_t release(buffer_handle_t handle);
 
 	int32_t lock(buffer_handle_t handle, int32_t acquire_fence, uint32_t map_flags,
-		     uint8_t *addr[DRV_MAX_PLANES]);
+		     uint8_t *addr[DRV_MAX_PLANES], int32_t timeout_ms);
 	int32_t unlock(buffer_handle_t handle, int32_t *release_fence);
 
 	int32_t get_backing_store(buffer_handle_t handle, uint64_t *out_store);
@@ -37,6 +39,12 @@ class cros_gralloc_driver
 	cros_gralloc_driver(cros_gralloc_driver const &);
 	cros_gralloc_driver operator=(cros_gralloc_driver const &);
 	cros_gralloc_buffer *get_buffer(cros_gralloc_handle_t hnd);
+	struct bo *create_bo(const struct cros_gralloc_buffer_descriptor *descriptor);
+	cros_gralloc_handle *create_handle(const struct cros_gralloc_buffer_descriptor *descriptor,
+					   struct bo *bo);
+	void destroy_handle(cros_gralloc_handle *hnd);
+	cros_gralloc_buffer *create_buffer(uint32_t id, struct bo *bo, cros_gralloc_handle *hnd);
+	void destroy_buffer(cros_gralloc_buffer *buffer);
 
 	struct driver *drv_;
         SpinLock mutex_;
@@ -317,7 +317,7 @@ static int gralloc0_lock_async(struct gralloc_module_t const *module, buffer_han
 	}
 
 	map_flags = gralloc0_convert_map_usage(usage);
-	ret = mod->driver->lock(handle, fence_fd, map_flags, addr);
+	ret = mod->driver->lock(handle, fence_fd, map_flags, addr, -1);
 	*vaddr = addr[0];
 	return ret;
 }
@@ -353,7 +353,7 @@ static int gralloc0_lock_async_ycbcr(struct gralloc_module_t const *module, buff
 	}
 
 	map_flags = gralloc0_convert_map_usage(usage);
-	ret = mod->driver->lock(handle, fence_fd, map_flags, addr);
+	ret = mod->driver->lock(handle, fence_fd, map_flags, addr, -1);
 	if (ret)
 		return ret;
 
@@ -24,6 +24,7 @@
 #include <hardware/gralloc.h>
 
 #include <inttypes.h>
+#include <vector>
 #include "../i915_private_android.h"
 #include "../i915_private_android_types.h"
 
@@ -379,12 +380,8 @@ int32_t CrosGralloc1::setModifier(gralloc1_buffer_descriptor_t descriptorId, uin
 	return CROS_GRALLOC_ERROR_NONE;
 }
 
-int32_t CrosGralloc1::allocate(struct cros_gralloc_buffer_descriptor *descriptor,
-			       buffer_handle_t *outBufferHandle)
+int32_t CrosGralloc1::validate(struct cros_gralloc_buffer_descriptor *descriptor)
 {
-	// If this function is being called, it's because we handed out its function
-	// pointer, which only occurs when mDevice has been loaded successfully and
-	// we are permitted to allocate
 	uint64_t usage =
 	    cros_gralloc1_convert_usage(descriptor->producer_usage, descriptor->consumer_usage);
 	descriptor->use_flags = usage;
@@ -402,33 +399,57 @@ int32_t CrosGralloc1::allocate(struct cros_gralloc_buffer_descriptor *descriptor
 				   static_cast<unsigned long long>(descriptor->use_flags));
 		return CROS_GRALLOC_ERROR_UNSUPPORTED;
 	}
+
+	return CROS_GRALLOC_ERROR_NONE;
+}
+
+int32_t CrosGralloc1::allocate(struct cros_gralloc_buffer_descriptor *descriptor,
+			       buffer_handle_t *outBufferHandle)
+{
+	// If this function is being called, it's because we handed out its function
+	// pointer, which only occurs when mDevice has been loaded successfully and
+	// we are permitted to allocate
+	int32_t error = validate(descriptor);
+	if (error != CROS_GRALLOC_ERROR_NONE)
+		return error;
+
 	if (driver->allocate(descriptor, outBufferHandle))
 		return CROS_GRALLOC_ERROR_NO_RESOURCES;
 
 	return CROS_GRALLOC_ERROR_NONE;
 }
 
+int32_t CrosGralloc1::allocateBatch(struct cros_gralloc_buffer_descriptor *const *descriptors,
+				    uint32_t numDescriptors, buffer_handle_t *outBuffers)
+{
+	for (uint32_t i = 0; i < numDescriptors; i++) {
+		int32_t error = validate(descriptors[i]);
+		if (error != CROS_GRALLOC_ERROR_NONE)
+			return error;
+	}
+
+	if (driver->allocate_batch(descriptors, numDescriptors, outBuffers))
+		return CROS_GRALLOC_ERROR_NO_RESOURCES;
+
+	return CROS_GRALLOC_ERROR_NONE;
+}
+
 int32_t CrosGralloc1::allocateBuffers(gralloc1_device_t *device, uint32_t numDescriptors,
 				      const gralloc1_buffer_descriptor_t *descriptors,
 				      buffer_handle_t *outBuffers)
 {
 	auto adapter = getAdapter(device);
+	std::vector<struct cros_gralloc_buffer_descriptor *> crosDescriptors(numDescriptors);
 	for (uint32_t i = 0; i < numDescriptors; i++) {
 		auto descriptor = (struct cros_gralloc_buffer_descriptor *)descriptors[i];
 		if (!descriptor) {
 			return CROS_GRALLOC_ERROR_BAD_DESCRIPTOR;
 		}
 
-		buffer_handle_t bufferHandle = nullptr;
-		int32_t error = adapter->allocate(descriptor, &bufferHandle);
-		if (error != CROS_GRALLOC_ERROR_NONE) {
-			return error;
-		}
-
-		outBuffers[i] = bufferHandle;
+		crosDescriptors[i] = descriptor;
 	}
 
-	return CROS_GRALLOC_ERROR_NONE;
+	return adapter->allocateBatch(crosDescriptors.data(), numDescriptors, outBuffers);
 }
 
 int32_t CrosGralloc1::retain(buffer_handle_t bufferHandle)
@@ -463,7 +484,7 @@ int32_t CrosGralloc1::lock(buffer_handle_t bufferHandle, gralloc1_producer_usage
 
 	map_flags = cros_gralloc1_convert_map_usage(producerUsage, consumerUsage);
 
-	if (driver->lock(bufferHandle, acquireFence, map_flags, addr))
+	if (driver->lock(bufferHandle, acquireFence, map_flags, addr, -1))
 		return CROS_GRALLOC_ERROR_BAD_HANDLE;
 
 	*outData = addr[0];
@@ -552,7 +573,7 @@ int32_t CrosGralloc1::lockYCbCr(buffer_handle_t bufferHandle,
 	}
 
 	map_flags = cros_gralloc1_convert_map_usage(producerUsage, consumerUsage);
-	if (driver->lock(bufferHandle, acquireFence, map_flags, addr))
+	if (driver->lock(bufferHandle, acquireFence, map_flags, addr, -1))
 		return CROS_GRALLOC_ERROR_BAD_HANDLE;
 
 	switch (hnd->format) {
@@ -245,6 +245,9 @@ class CrosGralloc1 : public gralloc1_device_t
 	}
 
 	// Buffer Management functions
+	int32_t validate(struct cros_gralloc_buffer_descriptor *descriptor);
+	int32_t allocateBatch(struct cros_gralloc_buffer_descriptor *const *descriptors,
+			      uint32_t numDescriptors, buffer_handle_t *outBuffers);
 	int32_t allocate(struct cros_gralloc_buffer_descriptor *descriptor,
 			 buffer_handle_t *outBufferHandle);
 	static int32_t allocateBuffers(gralloc1_device_t *device, uint32_t numDescriptors,
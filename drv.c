@@ -6,12 +6,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -45,6 +47,9 @@ extern struct backend backend_radeon;
 #ifdef DRV_ROCKCHIP
 extern struct backend backend_rockchip;
 #endif
+#ifdef DRV_SW
+extern struct backend backend_sw;
+#endif
 #ifdef DRV_TEGRA
 extern struct backend backend_tegra;
 #endif
@@ -60,8 +65,17 @@ static struct backend *drv_get_backend(int fd)
 	drmVersionPtr drm_version;
 	unsigned int i;
 
-	drm_version = drmGetVersion(fd);
+	/* Without a DRM device, allocate from system memory. */
+	if (fd < 0) {
+#ifdef DRV_SW
+		return &backend_sw;
+#else
+		return NULL;
+#endif
+	}
 
+	/* Callers probe nodes until one has a backend, so failures here aren't reported. */
+	drm_version = drmGetVersion(fd);
 	if (!drm_version)
 		return NULL;
 
@@ -110,6 +124,242 @@ static struct backend *drv_get_backend(int fd)
 	return NULL;
 }
 
+#define OBJECT_MAGAZINE_SIZE 16
+
+/* Objects of one size class cached by the calling thread. */
+struct object_magazine {
+	uint32_t count;
+	void *objects[OBJECT_MAGAZINE_SIZE];
+};
+
+/*
+ * The magazines of a thread. They belong to the allocator whose id they carry and sit on its list
+ * of caches, so that switching drivers or exiting the thread returns their objects to the owning
+ * allocator, and destroying the allocator detaches them. The lists are guarded by
+ * object_caches_lock, which also keeps the owner alive while a cache is flushed into it.
+ */
+struct object_cache {
+	atomic_uint id;
+	struct object_allocator *owner;
+	struct object_cache *next;
+	struct object_cache **pprev;
+	struct object_magazine magazines[DRV_OBJECT_CLASSES];
+};
+
+static __thread struct object_cache object_cache;
+
+static struct drv_mutex object_caches_lock;
+static pthread_key_t object_cache_key;
+static pthread_once_t object_cache_once = PTHREAD_ONCE_INIT;
+
+static atomic_uint object_allocator_ids = ATOMIC_VAR_INIT(0);
+
+static uint32_t drv_object_class(size_t size)
+{
+	uint32_t shift = DRV_OBJECT_MIN_SHIFT;
+
+	while ((1u << shift) < size)
+		shift++;
+
+	return shift - DRV_OBJECT_MIN_SHIFT;
+}
+
+/*
+ * Takes cache off its allocator's list. With flush, the cached objects go back to the free lists,
+ * otherwise they are dropped along with the allocator's slabs. Needs object_caches_lock.
+ */
+static void drv_object_cache_detach(struct object_cache *cache, bool flush)
+{
+	uint32_t class;
+	void *object;
+	struct object_class *cls;
+	struct object_magazine *magazine;
+
+	if (!cache->owner)
+		return;
+
+	for (class = 0; class < DRV_OBJECT_CLASSES; class++) {
+		magazine = &cache->magazines[class];
+		cls = &cache->owner->classes[class];
+
+		if (flush && magazine->count) {
+			DRV_LOCK(&cls->lock);
+			while (magazine->count) {
+				object = magazine->objects[--magazine->count];
+				*(void **)object = cls->free_list;
+				cls->free_list = object;
+			}
+			DRV_UNLOCK(&cls->lock);
+		}
+
+		magazine->count = 0;
+	}
+
+	*cache->pprev = cache->next;
+	if (cache->next)
+		cache->next->pprev = cache->pprev;
+
+	cache->owner = NULL;
+	atomic_store_explicit(&cache->id, 0, memory_order_relaxed);
+}
+
+/* Runs at thread exit for threads that allocated objects. */
+static void drv_object_cache_destroy(void *cache)
+{
+	DRV_LOCK(&object_caches_lock);
+	drv_object_cache_detach(cache, true);
+	DRV_UNLOCK(&object_caches_lock);
+}
+
+static void drv_object_cache_key_create(void)
+{
+	if (pthread_key_create(&object_cache_key, drv_object_cache_destroy))
+		fprintf(stderr, "drv: failed to create the object cache key\n");
+}
+
+/* Returns the magazine for class, first moving the thread's cache over to drv if needed. */
+static struct object_magazine *drv_object_magazine(struct driver *drv, uint32_t class)
+{
+	struct object_cache *cache = &object_cache;
+	struct object_allocator *objects = &drv->objects;
+
+	if (atomic_load_explicit(&cache->id, memory_order_relaxed) == objects->id)
+		return &cache->magazines[class];
+
+	pthread_once(&object_cache_once, drv_object_cache_key_create);
+	pthread_setspecific(object_cache_key, cache);
+
+	DRV_LOCK(&object_caches_lock);
+	drv_object_cache_detach(cache, true);
+
+	cache->owner = objects;
+	cache->next = objects->caches;
+	if (cache->next)
+		cache->next->pprev = &cache->next;
+	cache->pprev = &objects->caches;
+	objects->caches = cache;
+	atomic_store_explicit(&cache->id, objects->id, memory_order_relaxed);
+	DRV_UNLOCK(&object_caches_lock);
+
+	return &cache->magazines[class];
+}
+
+/* Moves up to half a magazine of objects from the free list, carving a new slab if needed. */
+static void drv_object_refill(struct object_class *cls, size_t size,
+			      struct object_magazine *magazine)
+{
+	uint32_t i;
+	char *slab;
+	void *object;
+
+	DRV_LOCK(&cls->lock);
+	while (magazine->count < OBJECT_MAGAZINE_SIZE / 2 && (object = cls->free_list)) {
+		cls->free_list = *(void **)object;
+		magazine->objects[magazine->count++] = object;
+	}
+	DRV_UNLOCK(&cls->lock);
+
+	if (magazine->count)
+		return;
+
+	/* The first slot links the slabs of the class together. */
+	slab = malloc(size * (DRV_OBJECTS_PER_SLAB + 1));
+	if (!slab)
+		return;
+
+	for (i = 1; i <= OBJECT_MAGAZINE_SIZE / 2; i++)
+		magazine->objects[magazine->count++] = slab + i * size;
+
+	DRV_LOCK(&cls->lock);
+	*(void **)slab = cls->slabs;
+	cls->slabs = slab;
+	for (; i <= DRV_OBJECTS_PER_SLAB; i++) {
+		object = slab + i * size;
+		*(void **)object = cls->free_list;
+		cls->free_list = object;
+	}
+	DRV_UNLOCK(&cls->lock);
+}
+
+/*
+ * Returns zeroed memory for a small object owned by drv, to be released with drv_object_free()
+ * using the same size. Sizes above DRV_OBJECT_MAX_SIZE fall back to calloc().
+ */
+void *drv_object_alloc(struct driver *drv, size_t size)
+{
+	void *object;
+	uint32_t class;
+	struct object_magazine *magazine;
+
+	if (size > DRV_OBJECT_MAX_SIZE)
+		return calloc(1, size);
+
+	class = drv_object_class(size);
+	magazine = drv_object_magazine(drv, class);
+	if (!magazine->count)
+		drv_object_refill(&drv->objects.classes[class],
+				  1u << (class + DRV_OBJECT_MIN_SHIFT), magazine);
+
+	if (!magazine->count)
+		return NULL;
+
+	object = magazine->objects[--magazine->count];
+	memset(object, 0, size);
+	return object;
+}
+
+void drv_object_free(struct driver *drv, void *object, size_t size)
+{
+	uint32_t class;
+	void *drained;
+	struct object_class *cls;
+	struct object_magazine *magazine;
+
+	if (!object)
+		return;
+
+	if (size > DRV_OBJECT_MAX_SIZE) {
+		free(object);
+		return;
+	}
+
+	class = drv_object_class(size);
+	cls = &drv->objects.classes[class];
+	magazine = drv_object_magazine(drv, class);
+
+	/* Return the older half of a full magazine to the shared free list. */
+	if (magazine->count == OBJECT_MAGAZINE_SIZE) {
+		DRV_LOCK(&cls->lock);
+		while (magazine->count > OBJECT_MAGAZINE_SIZE / 2) {
+			drained = magazine->objects[--magazine->count];
+			*(void **)drained = cls->free_list;
+			cls->free_list = drained;
+		}
+		DRV_UNLOCK(&cls->lock);
+	}
+
+	magazine->objects[magazine->count++] = object;
+}
+
+static void drv_object_allocator_fini(struct object_allocator *objects)
+{
+	uint32_t class;
+	void *slab;
+
+	DRV_LOCK(&object_caches_lock);
+	while (objects->caches)
+		drv_object_cache_detach(objects->caches, false);
+	DRV_UNLOCK(&object_caches_lock);
+
+	for (class = 0; class < DRV_OBJECT_CLASSES; class++) {
+		while ((slab = objects->classes[class].slabs)) {
+			objects->classes[class].slabs = *(void **)slab;
+			free(slab);
+		}
+	}
+}
+
+/* A negative fd selects the sw backend, when it is built in. */
 struct driver *drv_create(int fd)
 {
 	struct driver *drv;
@@ -122,42 +372,36 @@ struct driver *drv_create(int fd)
 
 	drv->fd = fd;
 	drv->backend = drv_get_backend(fd);
+	drv->objects.id = atomic_fetch_add(&object_allocator_ids, 1) + 1;
+	drv->map_prefault_min_size = DRV_MAP_PREFAULT_MIN_SIZE;
+	drv_copy_engine_init(&drv->copy_engine);
 
 	if (!drv->backend)
 		goto free_driver;
 
-	drv->buffer_table = drmHashCreate();
-	if (!drv->buffer_table)
-		goto free_driver;
-
-	drv->map_table = drmHashCreate();
-	if (!drv->map_table)
-		goto free_buffer_table;
-
 	/* Start with a power of 2 number of allocations. */
 	drv->combos.allocations = 2;
 	drv->combos.size = 0;
 
 	drv->combos.data = calloc(drv->combos.allocations, sizeof(struct combination));
 	if (!drv->combos.data)
-		goto free_map_table;
+		goto free_driver;
 
 	if (drv->backend->init) {
 		ret = drv->backend->init(drv);
 		if (ret) {
 			free(drv->combos.data);
-			goto free_map_table;
+			goto free_driver;
 		}
 	}
 
-	ATOMIC_VAR_INIT(drv->driver_lock);
+	/* Without an index drv_get_combination() still works, just slower. */
+	ret = drv_index_combinations(drv);
+	if (ret)
+		fprintf(stderr, "drv: failed to index combinations (%d)\n", ret);
 
 	return drv;
 
-free_map_table:
-	drmHashDestroy(drv->map_table);
-free_buffer_table:
-	drmHashDestroy(drv->buffer_table);
 free_driver:
 	free(drv);
 	return NULL;
@@ -165,19 +409,23 @@ free_driver:
 
 void drv_destroy(struct driver *drv)
 {
-	ATOMIC_LOCK(&drv->driver_lock);
+	uint32_t i;
+
+	drv_trim_bo_cache(drv, 0);
+	drv_copy_engine_fini(&drv->copy_engine);
 
        close(drv->fd);
 
 	if (drv->backend->close)
 		drv->backend->close(drv);
 
-	drmHashDestroy(drv->buffer_table);
-	drmHashDestroy(drv->map_table);
+	for (i = 0; i < DRV_LOCK_SHARDS; i++)
+		drv_handle_map_fini(&drv->shards[i].handles);
 
 	free(drv->combos.data);
+	free(drv->combos.ranges);
 
-	ATOMIC_UNLOCK(&drv->driver_lock);
+	drv_object_allocator_fini(&drv->objects);
 
 	free(drv);
 }
@@ -192,23 +440,91 @@ const char *drv_get_name(struct driver *drv)
 	return drv->backend->name;
 }
 
-struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
+#define COMBINATION_MEMO_SIZE 8
+
+/*
+ * Recent drv_get_combination() results of the calling thread. Allocation paths typically ask
+ * for the same (format, use_flags) pair several times per buffer (gbm/gralloc support check,
+ * then the backend). Entries are only valid for the index generation they were made with.
+ */
+struct combination_memo {
+	uint32_t generation;
+	uint32_t format;
+	uint64_t use_flags;
+	struct combination *combo;
+};
+
+static __thread struct combination_memo combination_memo[COMBINATION_MEMO_SIZE];
+
+static struct combination *drv_find_combination(struct driver *drv, uint32_t format,
+						uint64_t use_flags)
 {
 	struct combination *curr, *best;
+	struct combination_range *range;
+	uint32_t i, lo, hi, mid;
+
+	if (!drv->combos.generation) {
+		best = NULL;
+		for (i = 0; i < drv->combos.size; i++) {
+			curr = &drv->combos.data[i];
+			if ((format == curr->format) && use_flags == (curr->use_flags & use_flags))
+				if (!best || best->metadata.priority < curr->metadata.priority)
+					best = curr;
+		}
+
+		return best;
+	}
+
+	lo = 0;
+	hi = drv->combos.num_ranges;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (drv->combos.ranges[mid].format < format)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == drv->combos.num_ranges || drv->combos.ranges[lo].format != format)
+		return NULL;
+
+	/* Entries of a format are sorted by descending priority, so the first match wins. */
+	range = &drv->combos.ranges[lo];
+	for (i = range->first; i < range->first + range->count; i++) {
+		curr = &drv->combos.data[i];
+		if (use_flags == (curr->use_flags & use_flags))
+			return curr;
+	}
+
+	return NULL;
+}
+
+struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags)
+{
+	uint32_t generation;
+	struct combination *combo;
+	struct combination_memo *memo;
 
 	if (format == DRM_FORMAT_NONE || use_flags == BO_USE_NONE)
 		return 0;
 
-	best = NULL;
-	uint32_t i;
-	for (i = 0; i < drv->combos.size; i++) {
-		curr = &drv->combos.data[i];
-		if ((format == curr->format) && use_flags == (curr->use_flags & use_flags))
-			if (!best || best->metadata.priority < curr->metadata.priority)
-				best = curr;
+	generation = drv->combos.generation;
+	memo = &combination_memo[(format ^ (uint32_t)use_flags ^ (uint32_t)(use_flags >> 32)) %
+				 COMBINATION_MEMO_SIZE];
+	if (generation && memo->generation == generation && memo->format == format &&
+	    memo->use_flags == use_flags)
+		return memo->combo;
+
+	combo = drv_find_combination(drv, format, use_flags);
+
+	if (generation) {
+		memo->generation = generation;
+		memo->format = format;
+		memo->use_flags = use_flags;
+		memo->combo = combo;
 	}
 
-	return best;
+	return combo;
 }
 
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
@@ -216,7 +532,7 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 {
 
 	struct bo *bo;
-	bo = (struct bo *)calloc(1, sizeof(*bo));
+	bo = (struct bo *)drv_object_alloc(drv, sizeof(*bo));
 
 	if (!bo)
 		return NULL;
@@ -229,52 +545,376 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 	bo->num_planes = drv_num_planes_from_format(format);
 
 	if (!bo->num_planes) {
-		free(bo);
+		drv_object_free(drv, bo, sizeof(*bo));
+		return NULL;
+	}
+
+	return bo;
+}
+
+static uint64_t drv_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void drv_bo_cache_unlink(struct bo_cache *cache, struct bo_cache_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+
+	cache->size -= entry->bo->total_size;
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+/*
+ * Unlinks the least recently parked buffers until the cache fits in max_size and holds nothing
+ * older than the age limit. The evicted entries are chained through their next pointers so the
+ * caller can destroy them once the cache lock has been released. Assumes the cache lock is held.
+ */
+static struct bo_cache_entry *drv_bo_cache_evict(struct bo_cache *cache, size_t max_size,
+						 uint64_t now)
+{
+	struct bo_cache_entry *entry, *evicted = NULL;
+
+	while ((entry = cache->tail)) {
+		if (cache->size <= max_size &&
+		    (!cache->max_age_ms || now - entry->time_ms <= cache->max_age_ms))
+			break;
+
+		drv_bo_cache_unlink(cache, entry);
+		entry->next = evicted;
+		evicted = entry;
+	}
+
+	return evicted;
+}
+
+static void drv_bo_cache_release(struct bo_cache_entry *evicted)
+{
+	struct driver *drv;
+	struct bo_cache_entry *entry;
+
+	while ((entry = evicted)) {
+		evicted = entry->next;
+		drv = entry->bo->drv;
+		drv->backend->bo_destroy(entry->bo);
+		drv_object_free(drv, entry->bo, sizeof(*entry->bo));
+		drv_object_free(drv, entry, sizeof(*entry));
+	}
+}
+
+static struct bo *drv_bo_cache_get(struct driver *drv, uint32_t width, uint32_t height,
+				   uint32_t format, uint64_t use_flags)
+{
+	struct bo *bo = NULL;
+	struct bo_cache_entry *entry, *evicted;
+	struct bo_cache *cache = &drv->bo_cache;
+
+	if (!cache->max_size)
 		return NULL;
+
+	DRV_LOCK(&cache->lock);
+
+	evicted = drv_bo_cache_evict(cache, cache->max_size, drv_time_ms());
+	for (entry = cache->head; entry; entry = entry->next) {
+		if (entry->bo->create_width == width && entry->bo->create_height == height &&
+		    entry->bo->format == format && entry->bo->use_flags == use_flags) {
+			drv_bo_cache_unlink(cache, entry);
+			bo = entry->bo;
+			drv_object_free(drv, entry, sizeof(*entry));
+			break;
+		}
 	}
 
+	DRV_UNLOCK(&cache->lock);
+
+	drv_bo_cache_release(evicted);
 	return bo;
 }
 
+/*
+ * Parks a buffer whose last reference went away instead of destroying it. Returns false if the
+ * buffer can't be cached, in which case the caller still owns it.
+ */
+static bool drv_bo_cache_put(struct driver *drv, struct bo *bo)
+{
+	struct bo_cache_entry *entry, *evicted;
+	struct bo_cache *cache = &drv->bo_cache;
+
+	if (!bo->reusable || bo->shared || bo->total_size > cache->max_size)
+		return false;
+
+	entry = drv_object_alloc(drv, sizeof(*entry));
+	if (!entry)
+		return false;
+
+	entry->bo = bo;
+	entry->time_ms = drv_time_ms();
+
+	DRV_LOCK(&cache->lock);
+
+	entry->next = cache->head;
+	if (cache->head)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+
+	cache->head = entry;
+	cache->size += bo->total_size;
+	evicted = drv_bo_cache_evict(cache, cache->max_size, entry->time_ms);
+
+	DRV_UNLOCK(&cache->lock);
+
+	drv_bo_cache_release(evicted);
+	return true;
+}
+
+/* Fills in bo as a buffer of the given size, format and use flags that isn't allocated yet. */
+static int drv_bo_layout(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			 uint64_t use_flags, struct bo *bo)
+{
+	memset(bo, 0, sizeof(*bo));
+	bo->drv = drv;
+	bo->width = width;
+	bo->height = height;
+	bo->format = format;
+	bo->use_flags = use_flags;
+	bo->num_planes = drv_num_planes_from_format(format);
+
+	if (!bo->num_planes)
+		return -EINVAL;
+
+	return drv->backend->bo_compute_layout(bo, width, height, format, use_flags);
+}
+
+static void drv_bo_copy_layout(struct bo *bo, const struct bo *layout)
+{
+	bo->width = layout->width;
+	bo->height = layout->height;
+	bo->tiling = layout->tiling;
+	bo->total_size = layout->total_size;
+	memcpy(bo->offsets, layout->offsets, sizeof(bo->offsets));
+	memcpy(bo->sizes, layout->sizes, sizeof(bo->sizes));
+	memcpy(bo->strides, layout->strides, sizeof(bo->strides));
+	memcpy(bo->format_modifiers, layout->format_modifiers, sizeof(bo->format_modifiers));
+}
+
+/*
+ * Returns a recycled or newly created buffer, allocated with layout if that isn't NULL. Its
+ * handles aren't referenced in the buffer table yet; that is left to the caller so that batches
+ * can do it under a single lock.
+ */
+static struct bo *drv_bo_alloc(struct driver *drv, uint32_t width, uint32_t height,
+			       uint32_t format, uint64_t use_flags, const struct bo *layout)
+{
+	int ret;
+	struct bo *bo;
+
+	bo = drv_bo_cache_get(drv, width, height, format, use_flags);
+	if (bo)
+		return bo;
+
+	bo = drv_bo_new(drv, width, height, format, use_flags);
+
+	if (!bo)
+		return NULL;
+
+	if (layout) {
+		drv_bo_copy_layout(bo, layout);
+		ret = drv->backend->bo_create_from_layout(bo);
+	} else {
+		ret = drv->backend->bo_create(bo, width, height, format, use_flags);
+	}
+
+	if (ret) {
+		drv_object_free(bo->drv, bo, sizeof(*bo));
+		return NULL;
+	}
+
+	bo->create_width = width;
+	bo->create_height = height;
+	bo->reusable = true;
+	return bo;
+}
+
+/* Undoes drv_bo_alloc() for a buffer whose handles were never referenced. */
+static void drv_bo_release(struct bo *bo)
+{
+	if (drv_bo_cache_put(bo->drv, bo))
+		return;
+
+	bo->drv->backend->bo_destroy(bo);
+	drv_object_free(bo->drv, bo, sizeof(*bo));
+}
+
+static int drv_bo_reference_planes(struct driver *drv, struct bo *bo)
+{
+	size_t plane;
+
+	for (plane = 1; plane < bo->num_planes; plane++)
+		assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
+
+	return drv_bo_reference_handles(drv, bo);
+}
+
 struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t use_flags)
 {
 	int ret;
-	size_t plane;
 	struct bo *bo;
+	uint32_t shards;
 
-	bo = drv_bo_new(drv, width, height, format, use_flags);
+	bo = drv_bo_alloc(drv, width, height, format, use_flags, NULL);
 
 	if (!bo)
 		return NULL;
 
-	ret = drv->backend->bo_create(bo, width, height, format, use_flags);
+	shards = drv_bo_shards(bo);
+	drv_lock_shards(drv, shards);
+	ret = drv_bo_reference_planes(drv, bo);
+	drv_unlock_shards(drv, shards);
 
 	if (ret) {
-		free(bo);
+		drv_bo_release(bo);
 		return NULL;
 	}
 
-	ATOMIC_LOCK(&drv->driver_lock);
+	return bo;
+}
 
-	for (plane = 0; plane < bo->num_planes; plane++) {
-		if (plane > 0)
-			assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
+/*
+ * Creates count buffers at once, e.g. for a swapchain. Descriptors are validated up front, with
+ * identical consecutive descriptors validated only once, and all handles are registered with a
+ * single acquisition of the table locks. Either all buffers are returned in bos, or none are and
+ * a negative errno value is returned.
+ */
+int drv_bo_create_batch(struct driver *drv, const struct drv_bo_descriptor *descriptors,
+			uint32_t count, struct bo **bos)
+{
+	int ret = 0;
+	uint32_t i, j, shards = 0;
+	const struct drv_bo_descriptor *desc, *prev = NULL;
+	bool share_layout = drv->backend->bo_compute_layout && drv->backend->bo_create_from_layout;
+	struct bo layout;
+
+	if (!count)
+		return 0;
 
-		drv_increment_reference_count(drv, bo, plane);
+	for (i = 0; i < count; i++) {
+		desc = &descriptors[i];
+		if (prev && !memcmp(desc, prev, sizeof(*desc)))
+			continue;
+
+		if (!drv_num_planes_from_format(desc->format))
+			return -EINVAL;
+
+		prev = desc;
 	}
 
-	ATOMIC_UNLOCK(&drv->driver_lock);
+	/* Runs of identical descriptors share one layout computation. */
+	for (i = 0; i < count; i++) {
+		desc = &descriptors[i];
+		if (share_layout && (!i || memcmp(desc, &descriptors[i - 1], sizeof(*desc)))) {
+			ret = drv_bo_layout(drv, desc->width, desc->height, desc->format,
+					    desc->use_flags, &layout);
+			if (ret)
+				goto release;
+		}
 
-	return bo;
+		bos[i] = drv_bo_alloc(drv, desc->width, desc->height, desc->format,
+				      desc->use_flags, share_layout ? &layout : NULL);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			goto release;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		shards |= drv_bo_shards(bos[i]);
+
+	drv_lock_shards(drv, shards);
+
+	for (i = 0; i < count; i++) {
+		ret = drv_bo_reference_planes(drv, bos[i]);
+		if (ret)
+			break;
+	}
+
+	drv_unlock_shards(drv, shards);
+
+	if (!ret)
+		return 0;
+
+	/* Buffers before i hold references and are destroyed normally, the rest are released. */
+	for (j = 0; j < i; j++) {
+		drv_bo_destroy(bos[j]);
+		bos[j] = NULL;
+	}
+
+	i = count;
+release:
+	while (i--) {
+		if (bos[i]) {
+			drv_bo_release(bos[i]);
+			bos[i] = NULL;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Computes the layout drv_bo_create() would use, without allocating anything. Returns -ENOTSUP
+ * if the backend can't compute layouts without the kernel.
+ */
+int drv_bo_compute_layout(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			  uint64_t use_flags, struct drv_layout *layout)
+{
+	int ret;
+	size_t plane;
+	struct bo bo;
+
+	if (!drv->backend->bo_compute_layout)
+		return -ENOTSUP;
+
+	ret = drv_bo_layout(drv, width, height, format, use_flags, &bo);
+	if (ret)
+		return ret;
+
+	memset(layout, 0, sizeof(*layout));
+	layout->width = bo.width;
+	layout->height = bo.height;
+	layout->num_planes = bo.num_planes;
+	layout->tiling = bo.tiling;
+	layout->total_size = bo.total_size;
+
+	for (plane = 0; plane < bo.num_planes; plane++) {
+		layout->strides[plane] = bo.strides[plane];
+		layout->offsets[plane] = bo.offsets[plane];
+		layout->sizes[plane] = bo.sizes[plane];
+		layout->format_modifiers[plane] = bo.format_modifiers[plane];
+	}
+
+	return 0;
 }
 
 struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count)
 {
 	int ret;
-	size_t plane;
 	struct bo *bo;
+	uint32_t shards;
 
 	if (!drv->backend->bo_create_with_modifiers) {
 		errno = ENOENT;
@@ -289,46 +929,125 @@ struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint
 	ret = drv->backend->bo_create_with_modifiers(bo, width, height, format, modifiers, count);
 
 	if (ret) {
-		free(bo);
+		drv_object_free(bo->drv, bo, sizeof(*bo));
 		return NULL;
 	}
 
-	ATOMIC_LOCK(&drv->driver_lock);
-
-	for (plane = 0; plane < bo->num_planes; plane++) {
-		if (plane > 0)
-			assert(bo->offsets[plane] >= bo->offsets[plane - 1]);
+	shards = drv_bo_shards(bo);
+	drv_lock_shards(drv, shards);
+	ret = drv_bo_reference_planes(drv, bo);
+	drv_unlock_shards(drv, shards);
 
-		drv_increment_reference_count(drv, bo, plane);
+	if (ret) {
+		drv->backend->bo_destroy(bo);
+		drv_object_free(bo->drv, bo, sizeof(*bo));
+		return NULL;
 	}
 
-	ATOMIC_UNLOCK(&drv->driver_lock);
-
 	return bo;
 }
 
+/*
+ * Frees the record of a handle whose last reference went away, along with its idle mappings.
+ * Mappings that still have users, because their buffer was destroyed first, are left mapped with
+ * their shadows so that the memory doesn't go away under the caller; they are leaked.
+ */
+static int drv_bo_free_record(struct bo *bo, struct handle_record *record)
+{
+	int ret = 0;
+	uint32_t slot;
+	struct map_info *data;
+	int fd = atomic_load_explicit(&record->dma_buf_fd, memory_order_relaxed);
+
+	if (fd >= 0)
+		close(fd);
+
+	for (slot = 0; slot < DRV_MAP_SLOTS; slot++) {
+		data = record->maps[slot];
+		if (data && data->refcount) {
+			fprintf(stderr, "drv: mapped buffer destroyed, leaking its mapping\n");
+			continue;
+		}
+
+		if (data) {
+			if (bo->drv->backend->bo_unmap(bo, data)) {
+				fprintf(stderr, "drv: munmap failed");
+				ret = -1;
+			}
+
+			drv_object_free(bo->drv, data, sizeof(*data));
+		}
+
+		free(atomic_load_explicit(&record->shadows[slot], memory_order_relaxed));
+	}
+
+	drv_object_free(bo->drv, record, sizeof(*record));
+	return ret;
+}
+
+/* Destroys bo, whose mappings must have been unmapped; unmapping them afterwards isn't valid. */
 void drv_bo_destroy(struct bo *bo)
 {
-	size_t plane;
-	uintptr_t total = 0;
+	int ret;
+	size_t plane, later;
+	bool shared = false;
 	struct driver *drv = bo->drv;
 
-	ATOMIC_LOCK(&drv->driver_lock);
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		if (drv_decrement_reference_count(drv, bo, plane)) {
+			ret = drv_bo_free_record(bo, bo->records[plane]);
+			assert(ret == 0);
+			continue;
+		}
 
-	for (plane = 0; plane < bo->num_planes; plane++)
-		drv_decrement_reference_count(drv, bo, plane);
+		/* Planes sharing a handle: only the last one can drop the final reference. */
+		for (later = plane + 1; later < bo->num_planes; later++)
+			if (bo->records[later] == bo->records[plane])
+				break;
 
-	for (plane = 0; plane < bo->num_planes; plane++)
-		total += drv_get_reference_count(drv, bo, plane);
+		if (later == bo->num_planes)
+			shared = true;
+	}
 
-	ATOMIC_UNLOCK(&drv->driver_lock);
+	if (!shared) {
+		if (drv_bo_cache_put(drv, bo))
+			return;
 
-	if (total == 0) {
-		assert(drv_map_info_destroy(bo) == 0);
 		bo->drv->backend->bo_destroy(bo);
 	}
 
-	free(bo);
+	drv_object_free(bo->drv, bo, sizeof(*bo));
+}
+
+/*
+ * Enables recycling of destroyed buffers. Up to max_size bytes of buffers are kept and reused by
+ * drv_bo_create() calls with identical arguments, and buffers parked for longer than max_age_ms
+ * are released (zero means no age limit). A max_size of zero disables the cache.
+ */
+void drv_set_bo_cache_limits(struct driver *drv, size_t max_size, uint32_t max_age_ms)
+{
+	struct bo_cache_entry *evicted;
+
+	DRV_LOCK(&drv->bo_cache.lock);
+
+	drv->bo_cache.max_size = max_size;
+	drv->bo_cache.max_age_ms = max_age_ms;
+	evicted = drv_bo_cache_evict(&drv->bo_cache, max_size, drv_time_ms());
+
+	DRV_UNLOCK(&drv->bo_cache.lock);
+
+	drv_bo_cache_release(evicted);
+}
+
+void drv_trim_bo_cache(struct driver *drv, size_t max_size)
+{
+	struct bo_cache_entry *evicted;
+
+	DRV_LOCK(&drv->bo_cache.lock);
+	evicted = drv_bo_cache_evict(&drv->bo_cache, max_size, drv_time_ms());
+	DRV_UNLOCK(&drv->bo_cache.lock);
+
+	drv_bo_cache_release(evicted);
 }
 
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
@@ -345,10 +1064,12 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 
 	ret = drv->backend->bo_import(bo, data);
 	if (ret) {
-		free(bo);
+		drv_object_free(bo->drv, bo, sizeof(*bo));
 		return NULL;
 	}
 
+	bo->shared = true;
+
 	for (plane = 0; plane < bo->num_planes; plane++) {
 		bo->strides[plane] = data->strides[plane];
 		bo->offsets[plane] = data->offsets[plane];
@@ -381,13 +1102,73 @@ destroy_bo:
 	return NULL;
 }
 
+/*
+ * Unlinks the oldest idle mappings of a shard until it is within its share of the budget. They are
+ * chained through priv, which is unused for cached mappings, for drv_map_cache_release().
+ */
+static struct map_info *drv_map_cache_evict(struct driver *drv, struct map_cache *cache,
+					    struct map_info *evicted)
+{
+	uint32_t slot;
+	struct handle_record *record;
+	size_t max_size = drv->map_cache_max_size / DRV_LOCK_SHARDS;
+	uint32_t max_count = UINT32_MAX;
+
+	if (drv->map_cache_max_count)
+		max_count = DIV_ROUND_UP(drv->map_cache_max_count, DRV_LOCK_SHARDS);
+
+	while (cache->tail && (cache->size > max_size || cache->count > max_count)) {
+		record = cache->tail;
+		drv_map_cache_remove_record(cache, record);
+
+		for (slot = 0; slot < DRV_MAP_SLOTS; slot++) {
+			if (!record->maps[slot] || record->maps[slot]->refcount)
+				continue;
+
+			record->maps[slot]->priv = evicted;
+			evicted = record->maps[slot];
+			record->maps[slot] = NULL;
+		}
+	}
+
+	return evicted;
+}
+
+/* Only mappings without private data are cached, so a plain munmap() undoes them. */
+static void drv_map_cache_release(struct driver *drv, struct map_info *evicted)
+{
+	struct map_info *data;
+
+	while (evicted) {
+		data = evicted;
+		evicted = data->priv;
+		munmap(data->addr, data->length);
+		drv_object_free(drv, data, sizeof(*data));
+	}
+}
+
+/* Grows rect to also cover other. */
+static void drv_rect_union(struct rectangle *rect, const struct rectangle *other)
+{
+	uint32_t x2 = MAX(rect->x + rect->width, other->x + other->width);
+	uint32_t y2 = MAX(rect->y + rect->height, other->y + other->height);
+
+	rect->x = MIN(rect->x, other->x);
+	rect->y = MIN(rect->y, other->y);
+	rect->width = x2 - rect->x;
+	rect->height = y2 - rect->y;
+}
+
 void *drv_bo_map(struct bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 		 uint32_t map_flags, struct map_info **map_data, size_t plane)
 {
-	void *ptr;
 	uint8_t *addr;
 	size_t offset;
-	struct map_info *data;
+	struct map_info *data, *mapped;
+	struct rectangle rect = { x, y, width, height };
+	uint32_t slot = DRV_MAP_SLOT(map_flags);
+	struct handle_record *record = bo->records[plane];
+	struct drv_shard *shard = &bo->drv->shards[DRV_SHARD(record->handle)];
 
 	assert(width > 0);
 	assert(height > 0);
@@ -397,87 +1178,367 @@ void *drv_bo_map(struct bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t
 	/* No CPU access for protected buffers. */
 	assert(!(bo->use_flags & BO_USE_PROTECTED));
 
-	ATOMIC_LOCK(&bo->drv->driver_lock);
+	DRV_LOCK(&shard->lock);
 
-	if (!drmHashLookup(bo->drv->map_table, bo->handles[plane].u32, &ptr)) {
-		data = (struct map_info *)ptr;
-		/* TODO(gsingh): support mapping same buffer with different flags. */
-		assert(data->map_flags == map_flags);
+	data = record->maps[slot];
+	if (data) {
+		if (!data->refcount) {
+			drv_map_cache_remove(&shard->maps, record, slot);
+			shard->maps.hits++;
+			data->rect = rect;
+		} else {
+			drv_rect_union(&data->rect, &rect);
+		}
+
+		/* Writable mappings are shared by write-only and read-write users. */
+		data->map_flags |= map_flags;
 		data->refcount++;
+		DRV_UNLOCK(&shard->lock);
 		goto success;
 	}
 
-	data = calloc(1, sizeof(*data));
-	addr = bo->drv->backend->bo_map(bo, data, plane, map_flags);
+	shard->maps.misses++;
+	DRV_UNLOCK(&shard->lock);
+
+	/* The map ioctl and mmap() run unlocked; a racing mapping of the same handle wins below. */
+	data = drv_object_alloc(bo->drv, sizeof(*data));
+	addr = MAP_FAILED;
+	if (bo->drv->backend->flags & BACKEND_MAP_DMA_BUF)
+		addr = drv_dma_buf_bo_map(bo, data, plane, map_flags);
+
+	if (addr == MAP_FAILED)
+		addr = bo->drv->backend->bo_map(bo, data, plane, map_flags);
+
 	if (addr == MAP_FAILED) {
 		*map_data = NULL;
-		free(data);
-		ATOMIC_UNLOCK(&bo->drv->driver_lock);
+		drv_object_free(bo->drv, data, sizeof(*data));
 		return MAP_FAILED;
 	}
 
 	data->refcount = 1;
 	data->addr = addr;
-	data->handle = bo->handles[plane].u32;
+	data->handle = record->handle;
 	data->map_flags = map_flags;
-	drmHashInsert(bo->drv->map_table, bo->handles[plane].u32, (void *)data);
+	data->rect = rect;
+
+	DRV_LOCK(&shard->lock);
+
+	if (record->maps[slot]) {
+		mapped = record->maps[slot];
+		if (!mapped->refcount) {
+			drv_map_cache_remove(&shard->maps, record, slot);
+			mapped->rect = rect;
+		} else {
+			drv_rect_union(&mapped->rect, &rect);
+		}
+
+		mapped->map_flags |= map_flags;
+		mapped->refcount++;
+		DRV_UNLOCK(&shard->lock);
+
+		bo->drv->backend->bo_unmap(bo, data);
+		drv_object_free(bo->drv, data, sizeof(*data));
+		data = mapped;
+		goto success;
+	}
+
+	record->maps[slot] = data;
+	DRV_UNLOCK(&shard->lock);
+
+	/* Only mappings of the whole buffer are about to be touched all over. */
+	if (width == bo->width && height == bo->height)
+		drv_bo_advise_map(bo, data, bo->drv->map_prefault_min_size);
 
 success:
-	drv_bo_invalidate(bo, data);
+	drv_bo_invalidate_region(bo, data, &rect);
 	*map_data = data;
 	offset = drv_bo_get_plane_stride(bo, plane) * y;
 	offset += drv_stride_from_format(bo->format, x, plane);
 	addr = (uint8_t *)data->addr;
 	addr += drv_bo_get_plane_offset(bo, plane) + offset;
-	ATOMIC_UNLOCK(&bo->drv->driver_lock);
 
 	return (void *)addr;
 }
 
+/*
+ * Like drv_bo_map(), but waits at most timeout_ms for the GPU to finish with the buffer. If it
+ * doesn't, fails with errno set to EBUSY for a timeout of zero and to ETIME otherwise. A negative
+ * timeout waits as long as needed.
+ */
+void *drv_bo_map_try(struct bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		     uint32_t map_flags, struct map_info **map_data, size_t plane, int timeout_ms)
+{
+	int ret;
+
+	if (timeout_ms >= 0) {
+		ret = drv_bo_wait_idle(bo, map_flags, timeout_ms);
+		if (ret < 0) {
+			errno = (ret == -ETIME && !timeout_ms) ? EBUSY : -ret;
+			return MAP_FAILED;
+		}
+	}
+
+	return drv_bo_map(bo, x, y, width, height, map_flags, map_data, plane);
+}
+
 int drv_bo_unmap(struct bo *bo, struct map_info *data)
 {
+	int refcount;
+	size_t plane;
+	bool cached = false;
+	uint32_t slot = DRV_MAP_SLOT(data->map_flags);
+	struct driver *drv = bo->drv;
+	struct handle_record *record = NULL;
+	struct map_info *evicted = NULL;
+	struct drv_shard *shard = &drv->shards[DRV_SHARD(data->handle)];
 	int ret = drv_bo_flush(bo, data);
 	if (ret)
 		return ret;
 
-	ATOMIC_LOCK(&bo->drv->driver_lock);
+	for (plane = 0; plane < bo->num_planes; plane++)
+		if (bo->records[plane]->handle == data->handle)
+			record = bo->records[plane];
+
+	assert(record);
 
-	if (!--data->refcount) {
-		ret = bo->drv->backend->bo_unmap(bo, data);
-		drmHashDelete(bo->drv->map_table, data->handle);
-		free(data);
+	DRV_LOCK(&shard->lock);
+
+	refcount = --data->refcount;
+	if (!refcount) {
+		cached = !data->priv && data->length <= drv->map_cache_max_size / DRV_LOCK_SHARDS;
+		if (cached) {
+			drv_map_cache_insert(&shard->maps, record, slot);
+			evicted = drv_map_cache_evict(drv, &shard->maps, NULL);
+		} else {
+			record->maps[slot] = NULL;
+		}
 	}
 
-	ATOMIC_UNLOCK(&bo->drv->driver_lock);;
+	DRV_UNLOCK(&shard->lock);
+
+	drv_map_cache_release(drv, evicted);
+
+	if (!refcount && !cached) {
+		ret = drv->backend->bo_unmap(bo, data);
+		drv_object_free(drv, data, sizeof(*data));
+	}
 
 	return ret;
 }
 
+/*
+ * Copies the rows of plane that rect covers into dst, dst_stride bytes apart. Unlike reading
+ * through drv_bo_map(), this fetches write-combined mappings, such as those of i915 scanout
+ * buffers, with loads the backend's memory is fast for. rect is in pixels of the first plane and
+ * must be non-empty and within the buffer, or -EINVAL is returned.
+ */
+int drv_bo_read_region(struct bo *bo, size_t plane, const struct rectangle *rect, void *dst,
+		       uint32_t dst_stride)
+{
+	void *addr;
+	uint8_t *out = dst;
+	uint32_t row, rows;
+	size_t offset, row_bytes;
+	struct map_info *data;
+
+	/* Checked here rather than asserted in drv_bo_map(), as callers pass in client input. */
+	if (plane >= bo->num_planes || !rect->width || !rect->height ||
+	    rect->x > bo->width || rect->width > bo->width - rect->x ||
+	    rect->y > bo->height || rect->height > bo->height - rect->y)
+		return -EINVAL;
+
+	/* No CPU access for protected buffers. */
+	if (bo->use_flags & BO_USE_PROTECTED)
+		return -EINVAL;
+
+	addr = drv_bo_map(bo, rect->x, rect->y, rect->width, rect->height, BO_MAP_READ, &data,
+			  plane);
+	if (addr == MAP_FAILED)
+		return -EFAULT;
+
+	drv_bo_plane_region(bo, plane, rect, &offset, &row_bytes, &rows);
+	for (row = 0; row < rows; row++, offset += bo->strides[plane], out += dst_stride)
+		drv_copy_from_map(data, out, (uint8_t *)data->addr + offset, row_bytes);
+
+	return drv_bo_unmap(bo, data);
+}
+
+/*
+ * Enables caching of unmapped buffers' mappings. Up to max_size bytes of address space and, if
+ * max_count is not zero, max_count mappings are kept, split evenly between the shards. A max_size
+ * of zero disables the cache.
+ */
+void drv_set_map_cache_limits(struct driver *drv, size_t max_size, uint32_t max_count)
+{
+	uint32_t i;
+	struct map_info *evicted = NULL;
+
+	drv_lock_shards(drv, DRV_ALL_SHARDS);
+
+	drv->map_cache_max_size = max_size;
+	drv->map_cache_max_count = max_count;
+	for (i = 0; i < DRV_LOCK_SHARDS; i++)
+		evicted = drv_map_cache_evict(drv, &drv->shards[i].maps, evicted);
+
+	drv_unlock_shards(drv, DRV_ALL_SHARDS);
+
+	drv_map_cache_release(drv, evicted);
+}
+
+/*
+ * Sets the size from which new mappings of whole buffers with BO_USE_SW_*_OFTEN use flags are
+ * prefaulted. SIZE_MAX keeps all mappings lazy.
+ */
+void drv_set_map_prefault_size(struct driver *drv, size_t min_size)
+{
+	drv->map_prefault_min_size = min_size;
+}
+
+/*
+ * Sets the smallest CPU copy, such as a shadow or detiling copy, that is split across worker
+ * threads. SIZE_MAX keeps all copies on the calling thread. Not safe against concurrent copies.
+ */
+void drv_set_copy_threshold(struct driver *drv, size_t min_size)
+{
+	drv->copy_engine.min_size = min_size;
+}
+
+void drv_get_map_cache_stats(struct driver *drv, struct drv_map_cache_stats *stats)
+{
+	uint32_t i;
+	struct drv_shard *shard;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < DRV_LOCK_SHARDS; i++) {
+		shard = &drv->shards[i];
+		DRV_LOCK(&shard->lock);
+		stats->hits += shard->maps.hits;
+		stats->misses += shard->maps.misses;
+		stats->size += shard->maps.size;
+		stats->count += shard->maps.count;
+		DRV_UNLOCK(&shard->lock);
+	}
+}
+
 int drv_bo_invalidate(struct bo *bo, struct map_info *data)
+{
+	return drv_bo_invalidate_region(bo, data, &data->rect);
+}
+
+int drv_bo_flush(struct bo *bo, struct map_info *data)
+{
+	return drv_bo_flush_region(bo, data, &data->rect);
+}
+
+/* Like drv_bo_invalidate(), but only for the pixels in rect, which may extend to whole rows. */
+int drv_bo_invalidate_region(struct bo *bo, struct map_info *data, const struct rectangle *rect)
 {
 	int ret = 0;
 	assert(data);
 	assert(data->refcount >= 0);
+	assert(rect->x + rect->width <= drv_bo_get_width(bo));
+	assert(rect->y + rect->height <= drv_bo_get_height(bo));
+
+	/* Only shared buffers can have GPU work queued behind our back. */
+	if (bo->shared && !(bo->drv->backend->flags & BACKEND_INVALIDATE_WAITS)) {
+		ret = drv_bo_wait_idle(bo, data->map_flags, -1);
+		if (ret < 0)
+			return ret;
+
+		if (ret == 1 && (bo->drv->backend->flags & BACKEND_INVALIDATE_SKIP_IDLE))
+			return 0;
+	}
 
 	if (bo->drv->backend->bo_invalidate)
-		ret = bo->drv->backend->bo_invalidate(bo, data);
+		return bo->drv->backend->bo_invalidate(bo, data, rect);
 
-	return ret;
+	return 0;
 }
 
-int drv_bo_flush(struct bo *bo, struct map_info *data)
+/* Like drv_bo_flush(), but only for the pixels in rect, which may extend to whole rows. */
+int drv_bo_flush_region(struct bo *bo, struct map_info *data, const struct rectangle *rect)
 {
 	int ret = 0;
 	assert(data);
 	assert(data->refcount >= 0);
 	assert(!(bo->use_flags & BO_USE_PROTECTED));
+	assert(rect->x + rect->width <= drv_bo_get_width(bo));
+	assert(rect->y + rect->height <= drv_bo_get_height(bo));
 
 	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, data);
+		ret = bo->drv->backend->bo_flush(bo, data, rect);
 
 	return ret;
 }
 
+/*
+ * Waits up to timeout_ms, or without limit if it is negative, for GPU work that conflicts with CPU
+ * access of kind map_flags: pending writes for reads, and any pending access for writes. Returns 1
+ * if there was nothing to wait for, 0 if the buffer became idle and -ETIME if it didn't.
+ *
+ * Backends that can ask the kernel do so. Otherwise, shared buffers are polled through the
+ * implicit fences of their dma-buf, and the others are always idle.
+ */
+int drv_bo_wait_idle(struct bo *bo, uint32_t map_flags, int timeout_ms)
+{
+	int ret, wait_ms;
+	size_t plane, i, count = 0;
+	uint64_t deadline_ms;
+	struct pollfd fds[DRV_MAX_PLANES];
+	short events = (map_flags & BO_MAP_WRITE) ? POLLOUT : POLLIN;
+
+	if (bo->drv->backend->bo_wait)
+		return bo->drv->backend->bo_wait(bo, map_flags, timeout_ms);
+
+	if (!bo->shared)
+		return 1;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		for (i = 0; i < plane; i++)
+			if (bo->records[i] == bo->records[plane])
+				break;
+
+		if (i != plane)
+			continue;
+
+		ret = drv_bo_get_dma_buf(bo, plane);
+		if (ret < 0)
+			return ret;
+
+		fds[count].fd = ret;
+		fds[count].events = events;
+		fds[count].revents = 0;
+		count++;
+	}
+
+	/* The GPU is usually done by the time the CPU looks at the buffer; try without blocking. */
+	ret = poll(fds, count, 0);
+	if (ret < 0)
+		return -errno;
+
+	if ((size_t)ret == count)
+		return 1;
+
+	deadline_ms = drv_time_ms() + timeout_ms;
+	for (i = 0; i < count; i++) {
+		while (!fds[i].revents) {
+			wait_ms = -1;
+			if (timeout_ms >= 0)
+				wait_ms = MAX((int64_t)(deadline_ms - drv_time_ms()), 0);
+
+			ret = poll(&fds[i], 1, wait_ms);
+			if (ret < 0 && errno != EINTR)
+				return -errno;
+
+			if (ret == 0)
+				return -ETIME;
+		}
+	}
+
+	return 0;
+}
+
 uint32_t drv_bo_get_width(struct bo *bo)
 {
 	return bo->width;
@@ -498,8 +1559,16 @@ size_t drv_bo_get_num_planes(struct bo *bo)
 	return bo->num_planes;
 }
 
+struct driver *drv_bo_get_driver(struct bo *bo)
+{
+	return bo->drv;
+}
+
 union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane)
 {
+	/* The caller may submit GPU work with the handle behind the backend's back. */
+	bo->shared = true;
+	atomic_store_explicit(&bo->records[plane]->domains, 0, memory_order_relaxed);
 	return bo->handles[plane];
 }
 
@@ -513,6 +1582,13 @@ int drv_bo_get_plane_fd(struct bo *bo, size_t plane)
 	int ret, fd;
 	assert(plane < bo->num_planes);
 
+	/* Other processes may keep using the buffer, so it must not be recycled. */
+	bo->shared = true;
+	atomic_store_explicit(&bo->records[plane]->domains, 0, memory_order_relaxed);
+
+	if (bo->drv->backend->bo_get_plane_fd)
+		return bo->drv->backend->bo_get_plane_fd(bo, plane);
+
 	ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC | DRM_RDWR, &fd);
 
 	return (ret) ? ret : fd;
@@ -557,64 +1633,9 @@ uint32_t drv_resolve_format(struct driver *drv, uint32_t format, uint64_t use_fl
 
 size_t drv_num_planes_from_format(uint32_t format)
 {
-	switch (format) {
-	case DRM_FORMAT_ABGR1555:
-	case DRM_FORMAT_ABGR2101010:
-	case DRM_FORMAT_ABGR4444:
-	case DRM_FORMAT_ABGR8888:
-	case DRM_FORMAT_ARGB1555:
-	case DRM_FORMAT_ARGB2101010:
-	case DRM_FORMAT_ARGB4444:
-	case DRM_FORMAT_ARGB8888:
-	case DRM_FORMAT_AYUV:
-	case DRM_FORMAT_BGR233:
-	case DRM_FORMAT_BGR565:
-	case DRM_FORMAT_BGR888:
-	case DRM_FORMAT_BGRA1010102:
-	case DRM_FORMAT_BGRA4444:
-	case DRM_FORMAT_BGRA5551:
-	case DRM_FORMAT_BGRA8888:
-	case DRM_FORMAT_BGRX1010102:
-	case DRM_FORMAT_BGRX4444:
-	case DRM_FORMAT_BGRX5551:
-	case DRM_FORMAT_BGRX8888:
-	case DRM_FORMAT_C8:
-	case DRM_FORMAT_GR88:
-	case DRM_FORMAT_R8:
-	case DRM_FORMAT_RG88:
-	case DRM_FORMAT_RGB332:
-	case DRM_FORMAT_RGB565:
-	case DRM_FORMAT_RGB888:
-	case DRM_FORMAT_RGBA1010102:
-	case DRM_FORMAT_RGBA4444:
-	case DRM_FORMAT_RGBA5551:
-	case DRM_FORMAT_RGBA8888:
-	case DRM_FORMAT_RGBX1010102:
-	case DRM_FORMAT_RGBX4444:
-	case DRM_FORMAT_RGBX5551:
-	case DRM_FORMAT_RGBX8888:
-	case DRM_FORMAT_UYVY:
-	case DRM_FORMAT_VYUY:
-	case DRM_FORMAT_XBGR1555:
-	case DRM_FORMAT_XBGR2101010:
-	case DRM_FORMAT_XBGR4444:
-	case DRM_FORMAT_XBGR8888:
-	case DRM_FORMAT_XRGB1555:
-	case DRM_FORMAT_XRGB2101010:
-	case DRM_FORMAT_XRGB4444:
-	case DRM_FORMAT_XRGB8888:
-	case DRM_FORMAT_YUYV:
-	case DRM_FORMAT_YVYU:
-		return 1;
-	case DRM_FORMAT_NV12:
-	case DRM_FORMAT_NV21:
-		return 2;
-	case DRM_FORMAT_YVU420:
-	case DRM_FORMAT_YVU420_ANDROID:
-		return 3;
-	}
+	const struct format_desc *desc = drv_get_format_desc(format);
 
-	return i915_private_num_planes_from_format(format);
+	return desc ? desc->num_planes : 0;
 }
 
 uint32_t drv_num_buffers_per_bo(struct bo *bo)
@@ -12,6 +12,7 @@ extern "C" {
 #endif
 
 #include <drm_fourcc.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define DRV_MAX_PLANES 4
@@ -78,15 +79,52 @@ struct drv_import_fd_data {
 	uint64_t use_flags;
 };
 
+struct drv_bo_descriptor {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t use_flags;
+};
+
+struct drv_layout {
+	uint32_t width;
+	uint32_t height;
+	size_t num_planes;
+	uint32_t strides[DRV_MAX_PLANES];
+	uint32_t offsets[DRV_MAX_PLANES];
+	uint32_t sizes[DRV_MAX_PLANES];
+	uint64_t format_modifiers[DRV_MAX_PLANES];
+	uint32_t tiling;
+	uint64_t total_size;
+};
+
+struct rectangle {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
 struct map_info {
 	void *addr;
 	size_t length;
 	uint32_t handle;
 	uint32_t map_flags;
 	int32_t refcount;
+	/* Bounds of the regions passed to drv_bo_map() by the current users. */
+	struct rectangle rect;
+	/* Set by backends whose mapping bypasses the CPU caches, making plain loads slow. */
+	bool write_combined;
 	void *priv;
 };
 
+struct drv_map_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	size_t size;
+	uint32_t count;
+};
+
 struct driver *drv_create(int fd);
 
 void drv_destroy(struct driver *drv);
@@ -95,6 +133,10 @@ int drv_get_fd(struct driver *drv);
 
 const char *drv_get_name(struct driver *drv);
 
+void *drv_object_alloc(struct driver *drv, size_t size);
+
+void drv_object_free(struct driver *drv, void *object, size_t size);
+
 struct combination *drv_get_combination(struct driver *drv, uint32_t format, uint64_t use_flags);
 
 struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
@@ -106,19 +148,49 @@ struct bo *drv_bo_create(struct driver *drv, uint32_t width, uint32_t height, ui
 struct bo *drv_bo_create_with_modifiers(struct driver *drv, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count);
 
+int drv_bo_create_batch(struct driver *drv, const struct drv_bo_descriptor *descriptors,
+			uint32_t count, struct bo **bos);
+
+int drv_bo_compute_layout(struct driver *drv, uint32_t width, uint32_t height, uint32_t format,
+			  uint64_t use_flags, struct drv_layout *layout);
+
 void drv_bo_destroy(struct bo *bo);
 
+void drv_set_bo_cache_limits(struct driver *drv, size_t max_size, uint32_t max_age_ms);
+
+void drv_trim_bo_cache(struct driver *drv, size_t max_size);
+
+void drv_set_map_cache_limits(struct driver *drv, size_t max_size, uint32_t max_count);
+
+void drv_set_map_prefault_size(struct driver *drv, size_t min_size);
+
+void drv_set_copy_threshold(struct driver *drv, size_t min_size);
+
+void drv_get_map_cache_stats(struct driver *drv, struct drv_map_cache_stats *stats);
+
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data);
 
 void *drv_bo_map(struct bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 		 uint32_t map_flags, struct map_info **map_data, size_t plane);
 
+void *drv_bo_map_try(struct bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		     uint32_t map_flags, struct map_info **map_data, size_t plane, int timeout_ms);
+
 int drv_bo_unmap(struct bo *bo, struct map_info *data);
 
 int drv_bo_invalidate(struct bo *bo, struct map_info *data);
 
 int drv_bo_flush(struct bo *bo, struct map_info *data);
 
+int drv_bo_invalidate_region(struct bo *bo, struct map_info *data, const struct rectangle *rect);
+
+int drv_bo_flush_region(struct bo *bo, struct map_info *data, const struct rectangle *rect);
+
+int drv_bo_wait_idle(struct bo *bo, uint32_t map_flags, int timeout_ms);
+
+int drv_bo_read_region(struct bo *bo, size_t plane, const struct rectangle *rect, void *dst,
+		       uint32_t dst_stride);
+
 uint32_t drv_bo_get_width(struct bo *bo);
 
 uint32_t drv_bo_get_height(struct bo *bo);
@@ -127,6 +199,8 @@ uint32_t drv_bo_get_stride_or_tiling(struct bo *bo);
 
 size_t drv_bo_get_num_planes(struct bo *bo);
 
+struct driver *drv_bo_get_driver(struct bo *bo);
+
 union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane);
 
 int drv_bo_get_plane_fd(struct bo *bo, size_t plane);
@@ -8,6 +8,8 @@
 #define DRV_PRIV_H
 
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -15,18 +17,118 @@
 
 #include "drv.h"
 
-#ifndef DISABLE_LOCK
-#define ATOMIC_LOCK(X) \
-while (atomic_flag_test_and_set(X)) { \
-  }
+/*
+ * Lock that spins briefly and then sleeps on a futex. State is 0 when unlocked, 1 when locked
+ * and 2 when locked with possible waiters.
+ */
+struct drv_mutex {
+	atomic_int state;
+};
 
-#define ATOMIC_UNLOCK(X) \
-  atomic_flag_clear(X);
+#ifndef DISABLE_LOCK
+#define DRV_LOCK(X) drv_mutex_lock(X)
+#define DRV_UNLOCK(X) drv_mutex_unlock(X)
 #else
-#define ATOMIC_LOCK(X) ((void)0)
-#define ATOMIC_UNLOCK(X) ((void)0)
+#define DRV_LOCK(X) ((void)0)
+#define DRV_UNLOCK(X) ((void)0)
 #endif
 
+/*
+ * The handle table is split into shards by GEM handle, each with its own lock, so that threads
+ * working on unrelated buffers don't contend. Must be a power of two of at most 32.
+ */
+#define DRV_LOCK_SHARDS 16
+#define DRV_SHARD(handle) ((handle) & (DRV_LOCK_SHARDS - 1))
+#define DRV_ALL_SHARDS ((uint32_t)((1ull << DRV_LOCK_SHARDS) - 1))
+
+/*
+ * Open addressing hash map from GEM handle to pointer, with linear probing. Handle 0 is never
+ * valid in GEM and marks empty slots, and deletion shifts entries back instead of leaving
+ * tombstones, so probe sequences stay short without rehashing.
+ */
+struct handle_map_entry {
+	uint32_t key;
+	void *value;
+};
+
+struct handle_map {
+	struct handle_map_entry *entries;
+	uint32_t capacity;
+	uint32_t count;
+};
+
+/*
+ * Mappings kept after their last drv_bo_unmap(), so that mapping the buffer again needs no
+ * syscalls. Each shard caches the mappings of its own handles, most recently unmapped first,
+ * within its share of the driver's budget.
+ */
+struct map_cache {
+	struct handle_record *head;
+	struct handle_record *tail;
+	size_t size;
+	/* Number of idle mappings, a record may hold two. */
+	uint32_t count;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+struct drv_shard {
+	struct drv_mutex lock;
+	struct handle_map handles;
+	struct map_cache maps;
+};
+
+/*
+ * Slab allocator for small fixed-size objects (buffers, mappings, handle records and the wrappers
+ * of the gbm and gralloc layers). Sizes are rounded up to a power of two class; each class keeps
+ * a locked free list fed by slabs of DRV_OBJECTS_PER_SLAB objects. Threads allocate from
+ * per-class magazines and only touch the free list to refill or drain them.
+ */
+#define DRV_OBJECT_MIN_SHIFT 5
+#define DRV_OBJECT_CLASSES 5
+#define DRV_OBJECT_MAX_SIZE (1u << (DRV_OBJECT_MIN_SHIFT + DRV_OBJECT_CLASSES - 1))
+#define DRV_OBJECTS_PER_SLAB 64
+
+struct object_class {
+	struct drv_mutex lock;
+	void *free_list;
+	void *slabs;
+};
+
+struct object_cache;
+
+struct object_allocator {
+	/* Unique over all drivers, ties thread-local magazines to this allocator. */
+	uint32_t id;
+	struct object_class classes[DRV_OBJECT_CLASSES];
+	/* Thread caches holding objects of this allocator. */
+	struct object_cache *caches;
+};
+
+/* A handle has up to one mapping per protection: read-only and writable. */
+#define DRV_MAP_SLOTS 2
+#define DRV_MAP_SLOT(map_flags) (((map_flags) & BO_MAP_WRITE) ? 1 : 0)
+
+/*
+ * State of a GEM handle, shared by every struct bo whose planes use it. The refcount counts plane
+ * references; it only goes from 0 to 1 or from 1 to 0, and the record is only added to or removed
+ * from the handle table, with the shard lock held. The shard lock also protects maps, and the
+ * record is in the shard's map cache exactly when one of its mappings has no users.
+ */
+struct handle_record {
+	uint32_t handle;
+	atomic_uint refcount;
+	/* Cache domains the backend last moved the buffer to, zero when unknown. */
+	atomic_uint domains;
+	/* dma-buf of the handle for minigbm's own use, -1 until first needed. */
+	atomic_int dma_buf_fd;
+	struct map_info *maps[DRV_MAP_SLOTS];
+	/* Shadow copies of the buffer for backends that map through one, kept until release. */
+	_Atomic(void *) shadows[DRV_MAP_SLOTS];
+	struct handle_record *idle_prev;
+	struct handle_record *idle_next;
+};
+
 struct bo {
 	struct driver *drv;
 	uint32_t width;
@@ -35,6 +137,7 @@ struct bo {
 	uint32_t tiling;
 	size_t num_planes;
 	union bo_handle handles[DRV_MAX_PLANES];
+	struct handle_record *records[DRV_MAX_PLANES];
 	uint32_t offsets[DRV_MAX_PLANES];
 	uint32_t sizes[DRV_MAX_PLANES];
 	uint32_t strides[DRV_MAX_PLANES];
@@ -42,6 +145,47 @@ struct bo {
 	uint64_t use_flags;
 	size_t total_size;
 	void *priv;
+	/* Arguments of drv_bo_create(), which backends may pad, for matching cached buffers. */
+	uint32_t create_width;
+	uint32_t create_height;
+	/* Buffers made by drv_bo_create() may be recycled through the bo cache unless shared. */
+	bool reusable;
+	/*
+	 * Set once the buffer was imported or one of its handles or fds was handed out. From then
+	 * on GPU work that minigbm doesn't see may use it.
+	 */
+	bool shared;
+};
+
+struct bo_cache_entry {
+	struct bo *bo;
+	uint64_t time_ms;
+	struct bo_cache_entry *prev;
+	struct bo_cache_entry *next;
+};
+
+struct bo_cache {
+	/* Most recently parked buffer first. */
+	struct bo_cache_entry *head;
+	struct bo_cache_entry *tail;
+	size_t size;
+	size_t max_size;
+	uint32_t max_age_ms;
+	struct drv_mutex lock;
+};
+
+/*
+ * Layout properties of a pixel format. Plane strides derived from the first plane's stride are
+ * divided by stride_subsampling and rounded up to stride_alignment bytes, and plane heights are
+ * divided by vertical_subsampling.
+ */
+struct format_desc {
+	uint32_t format;
+	uint8_t num_planes;
+	uint8_t bpp[DRV_MAX_PLANES];
+	uint8_t vertical_subsampling[DRV_MAX_PLANES];
+	uint8_t stride_subsampling[DRV_MAX_PLANES];
+	uint8_t stride_alignment[DRV_MAX_PLANES];
 };
 
 struct kms_item {
@@ -62,36 +206,111 @@ struct combination {
 	uint64_t use_flags;
 };
 
+struct combination_range {
+	uint32_t format;
+	uint32_t first;
+	uint32_t count;
+};
+
 struct combinations {
 	struct combination *data;
 	uint32_t size;
 	uint32_t allocations;
+	/*
+	 * Per-format index over data, built by drv_index_combinations(). A generation of zero
+	 * means the index is stale and lookups fall back to a linear scan.
+	 */
+	struct combination_range *ranges;
+	uint32_t num_ranges;
+	uint32_t generation;
+};
+
+/* Most threads a copy runs on, the submitting one included. */
+#define DRV_COPY_MAX_THREADS 4
+
+typedef void (*drv_copy_func)(void *arg, uint32_t first, uint32_t last);
+
+/*
+ * Worker threads for large CPU copies, started by the first copy that needs them. One job runs
+ * at a time: its [0, count) range is split into chunks that the submitter and the workers claim
+ * from next. Copies submitted while the engine is busy run on the calling thread.
+ */
+struct copy_engine {
+	atomic_bool busy;
+	atomic_bool stop;
+	/* Bumped for every job, workers sleep on it. */
+	atomic_uint generation;
+	/* Workers still on the current job, the submitter sleeps on it. */
+	atomic_uint pending;
+	atomic_uint next;
+	drv_copy_func func;
+	void *arg;
+	uint32_t count;
+	uint32_t chunk;
+	bool started;
+	pid_t pid;
+	uint32_t num_workers;
+	pthread_t workers[DRV_COPY_MAX_THREADS - 1];
+	/* Copies smaller than min_size stay on the calling thread. */
+	size_t min_size;
+	/* Copies larger than the last level cache use non-temporal stores. */
+	size_t stream_min_size;
 };
 
 struct driver {
 	int fd;
 	struct backend *backend;
 	void *priv;
-	void *buffer_table;
-	void *map_table;
+	struct drv_shard shards[DRV_LOCK_SHARDS];
+	struct object_allocator objects;
 	struct combinations combos;
-	atomic_flag driver_lock;
+	struct bo_cache bo_cache;
+	/* Map cache budget, written with all shard locks held. */
+	size_t map_cache_max_size;
+	uint32_t map_cache_max_count;
+	size_t map_prefault_min_size;
+	struct copy_engine copy_engine;
 };
 
+/*
+ * Smallest mapping drv_bo_map() prefaults by default. tests/prefault_bench shows prefaulting
+ * paying off from 16 KiB up; below 64 KiB the gain is a few microseconds per map.
+ */
+#define DRV_MAP_PREFAULT_MIN_SIZE (64u << 10)
+
+/* Smallest copy split across the copy engine's workers by default. */
+#define DRV_COPY_PARALLEL_MIN_SIZE (4u << 20)
+
+/* Map buffers through their dma-buf, falling back to bo_map where the exporter can't. */
+#define BACKEND_MAP_DMA_BUF (1 << 0)
+/* bo_invalidate waits for the GPU itself, so drv_bo_invalidate() doesn't wait first. */
+#define BACKEND_INVALIDATE_WAITS (1 << 1)
+/* bo_invalidate only syncs with GPU work, so drv_bo_invalidate() skips it when none was pending. */
+#define BACKEND_INVALIDATE_SKIP_IDLE (1 << 2)
+
 struct backend {
 	char *name;
+	uint32_t flags;
 	int (*init)(struct driver *drv);
 	void (*close)(struct driver *drv);
 	int (*bo_create)(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			 uint64_t use_flags);
 	int (*bo_create_with_modifiers)(struct bo *bo, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count);
+	int (*bo_compute_layout)(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				 uint64_t use_flags);
+	/* Allocates memory for a buffer whose layout bo_compute_layout() filled in. */
+	int (*bo_create_from_layout)(struct bo *bo);
 	int (*bo_destroy)(struct bo *bo);
 	int (*bo_import)(struct bo *bo, struct drv_import_fd_data *data);
 	void *(*bo_map)(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags);
 	int (*bo_unmap)(struct bo *bo, struct map_info *data);
-	int (*bo_invalidate)(struct bo *bo, struct map_info *data);
-	int (*bo_flush)(struct bo *bo, struct map_info *data);
+	/* Returns 1 if idle, 0 after waiting for the GPU and -ETIME on timeout. */
+	int (*bo_wait)(struct bo *bo, uint32_t map_flags, int timeout_ms);
+	/* Called once GPU work of other users of a shared buffer has finished. */
+	int (*bo_invalidate)(struct bo *bo, struct map_info *data, const struct rectangle *rect);
+	int (*bo_flush)(struct bo *bo, struct map_info *data, const struct rectangle *rect);
+	int (*bo_get_plane_fd)(struct bo *bo, size_t plane);
 	uint32_t (*resolve_format)(uint32_t format, uint64_t use_flags);
 };
 
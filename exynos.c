@@ -39,11 +39,9 @@ static int exynos_init(struct driver *drv)
 	return drv_modify_linear_combinations(drv);
 }
 
-static int exynos_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-			    uint64_t use_flags)
+static int exynos_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height,
+				    uint32_t format, uint64_t use_flags)
 {
-	size_t plane;
-
 	if (format == DRM_FORMAT_NV12) {
 		uint32_t chroma_height;
 		/* V4L2 s5p-mfc requires width to be 16 byte aligned and height 32. */
@@ -62,11 +60,17 @@ static int exynos_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint
 		bo->offsets[0] = 0;
 	} else {
 		fprintf(stderr, "drv: unsupported format %X\n", format);
-		assert(0);
 		return -EINVAL;
 	}
 
+	return 0;
+}
+
+static int exynos_bo_create_from_layout(struct bo *bo)
+{
+	size_t plane;
 	int ret;
+
 	for (plane = 0; plane < bo->num_planes; plane++) {
 		size_t size = bo->sizes[plane];
 		struct drm_exynos_gem_create gem_create;
@@ -101,14 +105,31 @@ cleanup_planes:
 	return ret;
 }
 
+static int exynos_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			    uint64_t use_flags)
+{
+	int ret;
+
+	ret = exynos_bo_compute_layout(bo, width, height, format, use_flags);
+	if (ret) {
+		assert(0);
+		return ret;
+	}
+
+	return exynos_bo_create_from_layout(bo);
+}
+
 /*
  * Use dumb mapping with exynos even though a GEM buffer is created.
  * libdrm does the same thing in exynos_drm.c
  */
 struct backend backend_exynos = {
 	.name = "exynos",
+	.flags = BACKEND_MAP_DMA_BUF,
 	.init = exynos_init,
 	.bo_create = exynos_bo_create,
+	.bo_compute_layout = exynos_bo_compute_layout,
+	.bo_create_from_layout = exynos_bo_create_from_layout,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = drv_prime_bo_import,
 	.bo_map = drv_dumb_bo_map,
@@ -5,6 +5,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -93,7 +94,7 @@ static struct gbm_bo *gbm_bo_new(struct gbm_device *gbm, uint32_t format)
 {
 	struct gbm_bo *bo;
 
-	bo = (struct gbm_bo *)calloc(1, sizeof(*bo));
+	bo = (struct gbm_bo *)drv_object_alloc(gbm->drv, sizeof(*bo));
 	if (!bo)
 		return NULL;
 
@@ -119,13 +120,99 @@ PUBLIC struct gbm_bo *gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint
 	bo->bo = drv_bo_create(gbm->drv, width, height, format, gbm_convert_usage(usage));
 
 	if (!bo->bo) {
-		free(bo);
+		drv_object_free(gbm->drv, bo, sizeof(*bo));
 		return NULL;
 	}
 
 	return bo;
 }
 
+PUBLIC int gbm_bo_create_batch(struct gbm_device *gbm, uint32_t width, uint32_t height,
+				uint32_t format, uint32_t usage, uint32_t count,
+				struct gbm_bo **bos)
+{
+	int ret;
+	uint32_t i;
+	struct bo **drv_bos;
+	struct drv_bo_descriptor *descriptors;
+
+	if (!gbm_device_is_format_supported(gbm, format, usage))
+		return -EINVAL;
+
+	if (!count)
+		return 0;
+
+	descriptors = calloc(count, sizeof(*descriptors));
+	drv_bos = calloc(count, sizeof(*drv_bos));
+	if (!descriptors || !drv_bos) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		descriptors[i].width = width;
+		descriptors[i].height = height;
+		descriptors[i].format = format;
+		descriptors[i].use_flags = gbm_convert_usage(usage);
+
+		bos[i] = gbm_bo_new(gbm, format);
+		if (!bos[i]) {
+			ret = -ENOMEM;
+			goto free_bos;
+		}
+	}
+
+	ret = drv_bo_create_batch(gbm->drv, descriptors, count, drv_bos);
+	if (ret)
+		goto free_bos;
+
+	for (i = 0; i < count; i++)
+		bos[i]->bo = drv_bos[i];
+
+	goto out;
+
+free_bos:
+	while (i--) {
+		drv_object_free(gbm->drv, bos[i], sizeof(*bos[i]));
+		bos[i] = NULL;
+	}
+out:
+	free(descriptors);
+	free(drv_bos);
+	return ret;
+}
+
+PUBLIC int gbm_bo_compute_layout(struct gbm_device *gbm, uint32_t width, uint32_t height,
+				  uint32_t format, uint32_t usage, struct gbm_bo_layout *layout)
+{
+	int ret;
+	size_t plane;
+	struct drv_layout drv_layout;
+
+	if (!gbm_device_is_format_supported(gbm, format, usage))
+		return -EINVAL;
+
+	ret = drv_bo_compute_layout(gbm->drv, width, height, format, gbm_convert_usage(usage),
+				    &drv_layout);
+	if (ret)
+		return ret;
+
+	memset(layout, 0, sizeof(*layout));
+	layout->width = drv_layout.width;
+	layout->height = drv_layout.height;
+	layout->num_planes = drv_layout.num_planes;
+	layout->total_size = drv_layout.total_size;
+
+	for (plane = 0; plane < drv_layout.num_planes; plane++) {
+		layout->strides[plane] = drv_layout.strides[plane];
+		layout->offsets[plane] = drv_layout.offsets[plane];
+		layout->sizes[plane] = drv_layout.sizes[plane];
+		layout->format_modifiers[plane] = drv_layout.format_modifiers[plane];
+	}
+
+	return 0;
+}
+
 PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint32_t width,
 						   uint32_t height, uint32_t format,
 						   const uint64_t *modifiers, uint32_t count)
@@ -140,7 +227,7 @@ PUBLIC struct gbm_bo *gbm_bo_create_with_modifiers(struct gbm_device *gbm, uint3
 	bo->bo = drv_bo_create_with_modifiers(gbm->drv, width, height, format, modifiers, count);
 
 	if (!bo->bo) {
-		free(bo);
+		drv_object_free(gbm->drv, bo, sizeof(*bo));
 		return NULL;
 	}
 
@@ -156,7 +243,7 @@ PUBLIC void gbm_bo_destroy(struct gbm_bo *bo)
 	}
 
 	drv_bo_destroy(bo->bo);
-	free(bo);
+	drv_object_free(bo->gbm->drv, bo, sizeof(*bo));
 }
 
 PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void *buffer,
@@ -215,7 +302,7 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 	bo->bo = drv_bo_import(gbm->drv, &drv_data);
 
 	if (!bo->bo) {
-		free(bo);
+		drv_object_free(gbm->drv, bo, sizeof(*bo));
 		return NULL;
 	}
 
@@ -224,6 +311,13 @@ PUBLIC struct gbm_bo *gbm_bo_import(struct gbm_device *gbm, uint32_t type, void
 
 PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
 			uint32_t transfer_flags, uint32_t *stride, void **map_data, size_t plane)
+{
+	return gbm_bo_map_try(bo, x, y, width, height, transfer_flags, stride, map_data, plane, -1);
+}
+
+PUBLIC void *gbm_bo_map_try(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width,
+			    uint32_t height, uint32_t transfer_flags, uint32_t *stride,
+			    void **map_data, size_t plane, int timeout_ms)
 {
 	uint32_t map_flags;
 	if (!bo || width == 0 || height == 0 || !stride || !map_data)
@@ -232,8 +326,8 @@ PUBLIC void *gbm_bo_map(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t widt
 	*stride = gbm_bo_get_plane_stride(bo, plane);
 	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
 	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
-	return drv_bo_map(bo->bo, x, y, width, height, map_flags, (struct map_info **)map_data,
-			  plane);
+	return drv_bo_map_try(bo->bo, x, y, width, height, map_flags,
+			      (struct map_info **)map_data, plane, timeout_ms);
 }
 
 PUBLIC void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
@@ -242,6 +336,17 @@ PUBLIC void gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
 	drv_bo_unmap(bo->bo, map_data);
 }
 
+PUBLIC int gbm_bo_read(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		       void *dst, uint32_t dst_stride, size_t plane)
+{
+	struct rectangle rect = { x, y, width, height };
+
+	if (!bo || width == 0 || height == 0 || !dst)
+		return -EINVAL;
+
+	return drv_bo_read_region(bo->bo, plane, &rect, dst, dst_stride);
+}
+
 PUBLIC uint32_t gbm_bo_get_width(struct gbm_bo *bo)
 {
 	return drv_bo_get_width(bo->bo);
@@ -284,6 +284,29 @@ gbm_bo_create_with_modifiers(struct gbm_device *gbm,
                              uint32_t format,
                              const uint64_t *modifiers, uint32_t count);
 
+int
+gbm_bo_create_batch(struct gbm_device *gbm,
+                    uint32_t width, uint32_t height,
+                    uint32_t format, uint32_t flags,
+                    uint32_t count, struct gbm_bo **bos);
+
+struct gbm_bo_layout {
+   uint32_t width;
+   uint32_t height;
+   uint32_t num_planes;
+   uint32_t strides[GBM_MAX_PLANES];
+   uint32_t offsets[GBM_MAX_PLANES];
+   uint32_t sizes[GBM_MAX_PLANES];
+   uint64_t format_modifiers[GBM_MAX_PLANES];
+   uint64_t total_size;
+};
+
+int
+gbm_bo_compute_layout(struct gbm_device *gbm,
+                      uint32_t width, uint32_t height,
+                      uint32_t format, uint32_t flags,
+                      struct gbm_bo_layout *layout);
+
 #define GBM_BO_IMPORT_WL_BUFFER         0x5501
 #define GBM_BO_IMPORT_EGL_IMAGE         0x5502
 #define GBM_BO_IMPORT_FD                0x5503
@@ -343,9 +366,30 @@ gbm_bo_map(struct gbm_bo *bo,
            uint32_t x, uint32_t y, uint32_t width, uint32_t height,
            uint32_t flags, uint32_t *stride, void **map_data, size_t plane);
 
+/*
+ * Like gbm_bo_map(), but gives up after waiting timeout_ms for the GPU, with
+ * errno set to EBUSY if timeout_ms is zero and to ETIME otherwise.
+ */
+void *
+gbm_bo_map_try(struct gbm_bo *bo,
+               uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+               uint32_t flags, uint32_t *stride, void **map_data, size_t plane,
+               int timeout_ms);
+
 void
 gbm_bo_unmap(struct gbm_bo *bo, void *map_data);
 
+/*
+ * Copies a rectangle of plane into dst, whose rows are dst_stride bytes apart.
+ * Much faster than reading a mapping for buffers the CPU sees uncached, like
+ * scanout buffers. Returns 0 or a negative errno: -EINVAL if plane doesn't
+ * exist or the rectangle is empty or not within the buffer.
+ */
+int
+gbm_bo_read(struct gbm_bo *bo,
+            uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+            void *dst, uint32_t dst_stride, size_t plane);
+
 uint32_t
 gbm_bo_get_width(struct gbm_bo *bo);
 
@@ -6,102 +6,142 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/dma-buf.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <smmintrin.h>
+#endif
+
 #include "drv_priv.h"
 #include "helpers.h"
 #include "i915_private.h"
 #include "util.h"
 
-static uint32_t subsample_stride(uint32_t stride, uint32_t format, size_t plane)
-{
+/*
+ * Source of combination index generations. It is shared by all drivers so that a memoized
+ * lookup can never match an index belonging to another (possibly destroyed) driver.
+ */
+static atomic_uint combination_generation = ATOMIC_VAR_INIT(0);
 
-	if (plane != 0) {
-		switch (format) {
-		case DRM_FORMAT_YVU420:
-		case DRM_FORMAT_YVU420_ANDROID:
-			stride = DIV_ROUND_UP(stride, 2);
-			break;
-		}
+/*
+ * Every format known to minigbm, sorted by fourcc value for drv_get_format_desc(). The columns
+ * are: format, planes, bits per pixel, vertical subsampling, stride subsampling and stride
+ * alignment in bytes, the last four per plane.
+ */
+static const struct format_desc format_descs[] = {
+	{ DRM_FORMAT_C8, 1, { 8 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_R8, 1, { 8 }, { 1 }, { 1 }, { 1 } },
+#ifdef DRV_I915
+	{ DRM_FORMAT_R16, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_P010, 2, { 16, 8 }, { 1, 2 }, { 1, 1 }, { 1, 1 } },
+#endif
+	{ DRM_FORMAT_BGRA1010102, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGBA1010102, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_ABGR2101010, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_XBGR2101010, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_ARGB2101010, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_XRGB2101010, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_BGRX1010102, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGBX1010102, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_NV21, 2, { 8, 4 }, { 1, 2 }, { 1, 1 }, { 1, 1 } },
+	{ DRM_FORMAT_BGRA4444, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGBA4444, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_ABGR4444, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_XBGR4444, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_ARGB4444, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_XRGB4444, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+#ifdef DRV_I915
+	{ DRM_FORMAT_YUV420, 3, { 8, 8, 8 }, { 1, 2, 2 }, { 1, 1, 1 }, { 1, 1, 1 } },
+#endif
+	{ DRM_FORMAT_NV12, 2, { 8, 4 }, { 1, 2 }, { 1, 1 }, { 1, 1 } },
+	{ DRM_FORMAT_YVU420, 3, { 8, 8, 8 }, { 1, 2, 2 }, { 1, 2, 2 }, { 1, 1, 1 } },
+	{ DRM_FORMAT_BGRX4444, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGBX4444, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_BGRA8888, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGBA8888, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_ABGR8888, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_XBGR8888, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_BGR888, 1, { 24 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGB888, 1, { 24 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_ARGB8888, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_XRGB8888, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+#ifdef DRV_I915
+	{ DRM_FORMAT_YUV444, 3, { 8, 8, 8 }, { 1, 1, 1 }, { 1, 1, 1 }, { 1, 1, 1 } },
+#endif
+	{ DRM_FORMAT_BGRX8888, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGBX8888, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_BGRA5551, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGBA5551, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_ABGR1555, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_XBGR1555, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_ARGB1555, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_XRGB1555, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_BGRX5551, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGBX5551, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_BGR565, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGB565, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+#ifdef DRV_I915
+	{ DRM_FORMAT_YUV422, 3, { 8, 8, 8 }, { 1, 1, 1 }, { 1, 1, 1 }, { 1, 1, 1 } },
+	{ DRM_FORMAT_NV16, 2, { 8, 8 }, { 1, 1 }, { 1, 1 }, { 1, 1 } },
+	{ DRM_FORMAT_NV12_Y_TILED_INTEL, 2, { 8, 4 }, { 1, 2 }, { 1, 1 }, { 1, 1 } },
+#endif
+	{ DRM_FORMAT_YVU420_ANDROID, 3, { 8, 8, 8 }, { 1, 2, 2 }, { 1, 2, 2 }, { 32, 16, 16 } },
+	{ DRM_FORMAT_RG88, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_GR88, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_RGB332, 1, { 8 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_BGR233, 1, { 8 }, { 1 }, { 1 }, { 1 } },
+#ifdef DRV_I915
+	{ DRM_FORMAT_ABGR16161616F, 1, { 64 }, { 1 }, { 1 }, { 1 } },
+#endif
+	{ DRM_FORMAT_YVYU, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_AYUV, 1, { 32 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_YUYV, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_VYUY, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+	{ DRM_FORMAT_UYVY, 1, { 16 }, { 1 }, { 1 }, { 1 } },
+};
+
+const struct format_desc *drv_get_format_desc(uint32_t format)
+{
+	uint32_t lo = 0, hi = ARRAY_SIZE(format_descs), mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (format_descs[mid].format < format)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	return stride;
+	if (lo == ARRAY_SIZE(format_descs) || format_descs[lo].format != format)
+		return NULL;
+
+	return &format_descs[lo];
 }
 
 static uint32_t bpp_from_format(uint32_t format, size_t plane)
 {
-	assert(plane < drv_num_planes_from_format(format));
-
-	switch (format) {
-	case DRM_FORMAT_BGR233:
-	case DRM_FORMAT_C8:
-	case DRM_FORMAT_R8:
-	case DRM_FORMAT_RGB332:
-	case DRM_FORMAT_YVU420:
-	case DRM_FORMAT_YVU420_ANDROID:
-		return 8;
-
-	case DRM_FORMAT_NV12:
-	case DRM_FORMAT_NV21:
-		return (plane == 0) ? 8 : 4;
-
-	case DRM_FORMAT_ABGR1555:
-	case DRM_FORMAT_ABGR4444:
-	case DRM_FORMAT_ARGB1555:
-	case DRM_FORMAT_ARGB4444:
-	case DRM_FORMAT_BGR565:
-	case DRM_FORMAT_BGRA4444:
-	case DRM_FORMAT_BGRA5551:
-	case DRM_FORMAT_BGRX4444:
-	case DRM_FORMAT_BGRX5551:
-	case DRM_FORMAT_GR88:
-	case DRM_FORMAT_RG88:
-	case DRM_FORMAT_RGB565:
-	case DRM_FORMAT_RGBA4444:
-	case DRM_FORMAT_RGBA5551:
-	case DRM_FORMAT_RGBX4444:
-	case DRM_FORMAT_RGBX5551:
-	case DRM_FORMAT_UYVY:
-	case DRM_FORMAT_VYUY:
-	case DRM_FORMAT_XBGR1555:
-	case DRM_FORMAT_XBGR4444:
-	case DRM_FORMAT_XRGB1555:
-	case DRM_FORMAT_XRGB4444:
-	case DRM_FORMAT_YUYV:
-	case DRM_FORMAT_YVYU:
-		return 16;
-
-	case DRM_FORMAT_BGR888:
-	case DRM_FORMAT_RGB888:
-		return 24;
-
-	case DRM_FORMAT_ABGR2101010:
-	case DRM_FORMAT_ABGR8888:
-	case DRM_FORMAT_ARGB2101010:
-	case DRM_FORMAT_ARGB8888:
-	case DRM_FORMAT_AYUV:
-	case DRM_FORMAT_BGRA1010102:
-	case DRM_FORMAT_BGRA8888:
-	case DRM_FORMAT_BGRX1010102:
-	case DRM_FORMAT_BGRX8888:
-	case DRM_FORMAT_RGBA1010102:
-	case DRM_FORMAT_RGBA8888:
-	case DRM_FORMAT_RGBX1010102:
-	case DRM_FORMAT_RGBX8888:
-	case DRM_FORMAT_XBGR2101010:
-	case DRM_FORMAT_XBGR8888:
-	case DRM_FORMAT_XRGB2101010:
-	case DRM_FORMAT_XRGB8888:
-		return 32;
-	}
-
-	return i915_private_bpp_from_format(format, plane);
+	const struct format_desc *desc = drv_get_format_desc(format);
+
+	assert(desc && plane < desc->num_planes);
+	return desc->bpp[plane];
 }
 
 uint32_t drv_bo_get_stride_in_pixels(struct bo *bo)
@@ -115,34 +155,23 @@ uint32_t drv_bo_get_stride_in_pixels(struct bo *bo)
  */
 uint32_t drv_stride_from_format(uint32_t format, uint32_t width, size_t plane)
 {
-	uint32_t stride = DIV_ROUND_UP(width * bpp_from_format(format, plane), 8);
+	const struct format_desc *desc = drv_get_format_desc(format);
+
+	assert(desc && plane < desc->num_planes);
 
 	/*
 	 * The stride of Android YV12 buffers is required to be aligned to 16 bytes
 	 * (see <system/graphics.h>).
 	 */
-	if (format == DRM_FORMAT_YVU420_ANDROID)
-		stride = (plane == 0) ? ALIGN(stride, 32) : ALIGN(stride, 16);
-
-	return stride;
+	return ALIGN(DIV_ROUND_UP(width * desc->bpp[plane], 8), desc->stride_alignment[plane]);
 }
 
 uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane)
 {
-	assert(plane < drv_num_planes_from_format(format));
-	uint32_t vertical_subsampling;
+	const struct format_desc *desc = drv_get_format_desc(format);
 
-	switch (format) {
-	case DRM_FORMAT_NV12:
-	case DRM_FORMAT_YVU420:
-	case DRM_FORMAT_YVU420_ANDROID:
-		vertical_subsampling = (plane == 0) ? 1 : 2;
-		break;
-	default:
-		i915_private_vertical_subsampling_from_format(&vertical_subsampling, format, plane);
-	}
-
-	return stride * DIV_ROUND_UP(height, vertical_subsampling);
+	assert(desc && plane < desc->num_planes);
+	return stride * DIV_ROUND_UP(height, desc->vertical_subsampling[plane]);
 }
 
 /*
@@ -153,11 +182,11 @@ uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height,
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height, uint32_t format)
 {
 
-	size_t p, num_planes;
+	size_t p;
 	uint32_t offset = 0;
+	const struct format_desc *desc = drv_get_format_desc(format);
 
-	num_planes = drv_num_planes_from_format(format);
-	assert(num_planes);
+	assert(desc);
 
 	/*
 	 * HAL_PIXEL_FORMAT_YV12 requires that (see <system/graphics.h>):
@@ -170,9 +199,10 @@ int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height,
 		assert(stride == ALIGN(stride, 32));
 	}
 
-	for (p = 0; p < num_planes; p++) {
-		bo->strides[p] = subsample_stride(stride, format, p);
-		bo->sizes[p] = drv_size_from_format(format, bo->strides[p], aligned_height, p);
+	for (p = 0; p < desc->num_planes; p++) {
+		bo->strides[p] = DIV_ROUND_UP(stride, desc->stride_subsampling[p]);
+		bo->sizes[p] = bo->strides[p] *
+			       DIV_ROUND_UP(aligned_height, desc->vertical_subsampling[p]);
 		bo->offsets[p] = offset;
 		offset += bo->sizes[p];
 	}
@@ -181,6 +211,297 @@ int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height,
 	return 0;
 }
 
+/*
+ * Finds the bytes of a plane covered by rect, which is in pixels of the first plane: rows rows of
+ * row_bytes bytes, strides[plane] apart, the first at offset from the start of the buffer.
+ */
+void drv_bo_plane_region(struct bo *bo, size_t plane, const struct rectangle *rect, size_t *offset,
+			 size_t *row_bytes, uint32_t *rows)
+{
+	const struct format_desc *desc = drv_get_format_desc(bo->format);
+	uint32_t x1, x2, first_row, subsampling;
+	size_t start, end;
+
+	/* Planes the format doesn't describe, like compression control surfaces. */
+	if (!desc || plane >= desc->num_planes) {
+		*offset = bo->offsets[plane];
+		*row_bytes = 0;
+		*rows = 0;
+		return;
+	}
+
+	/*
+	 * Rows of later planes are those of the first plane divided by stride_subsampling. Chroma
+	 * samples cover pixel pairs, so widen the span to even pixels for those.
+	 */
+	x1 = rect->x;
+	x2 = rect->x + rect->width;
+	if (plane > 0) {
+		x1 &= ~1u;
+		x2 = ALIGN(x2, 2);
+	}
+
+	subsampling = desc->stride_subsampling[plane];
+	start = (size_t)x1 * desc->bpp[0] / 8 / subsampling;
+	end = DIV_ROUND_UP(DIV_ROUND_UP((size_t)x2 * desc->bpp[0], 8), subsampling);
+
+	subsampling = desc->vertical_subsampling[plane];
+	first_row = rect->y / subsampling;
+
+	*offset = bo->offsets[plane] + (size_t)first_row * bo->strides[plane] + start;
+	*row_bytes = MIN(end, bo->strides[plane]) - start;
+	*rows = DIV_ROUND_UP(rect->y + rect->height, subsampling) - first_row;
+}
+
+/* Copies with stores that bypass the cache, for copies too large to stay in it anyway. */
+static void drv_copy_stream(uint8_t *dst, const uint8_t *src, size_t size)
+{
+#if defined(__SSE2__)
+	size_t head = MIN(-(uintptr_t)dst & 15, size);
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+struct copy_rows {
+	uint8_t *dst;
+	const uint8_t *src;
+	size_t offset;
+	size_t row_bytes;
+	uint32_t stride;
+	bool stream;
+};
+
+static void drv_copy_rows(void *arg, uint32_t first, uint32_t last)
+{
+	struct copy_rows *copy = arg;
+	size_t offset = copy->offset + (size_t)first * copy->stride;
+	size_t size = copy->row_bytes;
+	uint32_t row, rows = last - first;
+
+	/* Rows without padding in between are copied in one go. */
+	if (copy->row_bytes == copy->stride) {
+		size *= rows;
+		rows = 1;
+	}
+
+	for (row = 0; row < rows; row++, offset += copy->stride) {
+		if (copy->stream)
+			drv_copy_stream(copy->dst + offset, copy->src + offset, size);
+		else
+			memcpy(copy->dst + offset, copy->src + offset, size);
+	}
+
+#if defined(__SSE2__)
+	/* Make the streamed rows visible before the job is reported done. */
+	if (copy->stream)
+		_mm_sfence();
+#endif
+}
+
+/* Copies the pixels in rect between two CPU copies of the whole buffer. */
+void drv_bo_copy_region(struct bo *bo, uint8_t *dst, const uint8_t *src,
+			const struct rectangle *rect)
+{
+	size_t plane, offset, row_bytes;
+	uint32_t row, rows;
+	struct copy_rows copy;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		drv_bo_plane_region(bo, plane, rect, &offset, &row_bytes, &rows);
+
+		if (row_bytes * rows >= bo->drv->copy_engine.min_size) {
+			copy.dst = dst;
+			copy.src = src;
+			copy.offset = offset;
+			copy.row_bytes = row_bytes;
+			copy.stride = bo->strides[plane];
+			copy.stream = row_bytes * rows >= bo->drv->copy_engine.stream_min_size;
+			drv_copy_run(bo->drv, drv_copy_rows, &copy, rows, row_bytes * rows);
+			continue;
+		}
+
+		if (row_bytes == bo->strides[plane]) {
+			memcpy(dst + offset, src + offset, row_bytes * rows);
+			continue;
+		}
+
+		for (row = 0; row < rows; row++, offset += bo->strides[plane])
+			memcpy(dst + offset, src + offset, row_bytes);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Streaming loads fetch write-combined memory a line at a time, where plain loads are uncached. */
+__attribute__((target("sse4.1"))) static void drv_copy_stream_load(uint8_t *dst,
+								   const uint8_t *src, size_t size)
+{
+	size_t head = MIN(-(uintptr_t)src & 15, size);
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_stream_load_si128((__m128i *)(uintptr_t)src);
+		__m128i b = _mm_stream_load_si128((__m128i *)(uintptr_t)(src + 16));
+		__m128i c = _mm_stream_load_si128((__m128i *)(uintptr_t)(src + 32));
+		__m128i d = _mm_stream_load_si128((__m128i *)(uintptr_t)(src + 48));
+		_mm_storeu_si128((__m128i *)dst, a);
+		_mm_storeu_si128((__m128i *)(dst + 16), b);
+		_mm_storeu_si128((__m128i *)(dst + 32), c);
+		_mm_storeu_si128((__m128i *)(dst + 48), d);
+	}
+
+	memcpy(dst, src, size);
+}
+#endif
+
+/* Copies from the CPU mapping data, with streaming loads if it is write-combined. */
+void drv_copy_from_map(struct map_info *data, uint8_t *dst, const uint8_t *src, size_t size)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (data->write_combined && __builtin_cpu_supports("sse4.1")) {
+		drv_copy_stream_load(dst, src, size);
+		return;
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+#ifndef DRM_RDWR
+#define DRM_RDWR O_RDWR
+#endif
+
+/*
+ * Returns a dma-buf fd for the handle of plane, exported on first use and kept open until the
+ * handle is released. Exporting doesn't make the buffer shared; the fd never leaves minigbm.
+ */
+int drv_bo_get_dma_buf(struct bo *bo, size_t plane)
+{
+	int ret, fd, expected = -1;
+	struct handle_record *record = bo->records[plane];
+
+	fd = atomic_load_explicit(&record->dma_buf_fd, memory_order_acquire);
+	if (fd >= 0)
+		return fd;
+
+	if (bo->drv->backend->bo_get_plane_fd) {
+		fd = bo->drv->backend->bo_get_plane_fd(bo, plane);
+	} else {
+		ret = drmPrimeHandleToFD(bo->drv->fd, record->handle, DRM_CLOEXEC | DRM_RDWR, &fd);
+		if (ret)
+			fd = ret;
+	}
+
+	if (fd < 0)
+		return fd;
+
+	/* Another thread may have got there first. */
+	if (!atomic_compare_exchange_strong_explicit(&record->dma_buf_fd, &expected, fd,
+						     memory_order_acq_rel, memory_order_acquire)) {
+		close(fd);
+		fd = expected;
+	}
+
+	return fd;
+}
+
+/*
+ * Returns a shadow of size bytes for mappings of plane with map_flags, to be used instead of
+ * uncached GEM memory. It is zeroed on first use and reused until the handle is released; after
+ * that its contents are whatever the last mapping left there. A backend must always pass the same
+ * size for a handle.
+ */
+void *drv_bo_get_shadow(struct bo *bo, size_t plane, uint32_t map_flags, size_t size)
+{
+	void *shadow, *expected = NULL;
+	struct handle_record *record = bo->records[plane];
+	uint32_t slot = DRV_MAP_SLOT(map_flags);
+
+	shadow = atomic_load_explicit(&record->shadows[slot], memory_order_acquire);
+	if (shadow)
+		return shadow;
+
+	shadow = calloc(1, size);
+	if (!shadow)
+		return NULL;
+
+	/* Another thread may have got there first. */
+	if (!atomic_compare_exchange_strong_explicit(&record->shadows[slot], &expected, shadow,
+						     memory_order_acq_rel, memory_order_acquire)) {
+		free(shadow);
+		shadow = expected;
+	}
+
+	return shadow;
+}
+
+static int drv_dma_buf_sync(struct bo *bo, uint32_t map_flags, uint64_t flags)
+{
+	int fd;
+	size_t plane, i;
+	struct dma_buf_sync sync;
+
+	if (map_flags & BO_MAP_READ)
+		flags |= DMA_BUF_SYNC_READ;
+	if (map_flags & BO_MAP_WRITE)
+		flags |= DMA_BUF_SYNC_WRITE;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		for (i = 0; i < plane; i++)
+			if (bo->records[i] == bo->records[plane])
+				break;
+
+		if (i != plane)
+			continue;
+
+		fd = drv_bo_get_dma_buf(bo, plane);
+		if (fd < 0)
+			return fd;
+
+		memset(&sync, 0, sizeof(sync));
+		sync.flags = flags;
+		if (drmIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+			fprintf(stderr, "drv: DMA_BUF_IOCTL_SYNC failed with %d\n", errno);
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * bo_invalidate and bo_flush hooks for backends whose exporter keeps cached CPU mappings coherent
+ * in the dma-buf begin/end_cpu_access callbacks. DMA_BUF_IOCTL_SYNC has no range form, so rect is
+ * ignored and the whole buffer is synced.
+ */
+int drv_dma_buf_invalidate(struct bo *bo, struct map_info *data, const struct rectangle *rect)
+{
+	return drv_dma_buf_sync(bo, data->map_flags, DMA_BUF_SYNC_START);
+}
+
+int drv_dma_buf_flush(struct bo *bo, struct map_info *data, const struct rectangle *rect)
+{
+	return drv_dma_buf_sync(bo, data->map_flags, DMA_BUF_SYNC_END);
+}
+
 int drv_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		       uint64_t use_flags)
 {
@@ -270,10 +591,55 @@ int drv_gem_bo_destroy(struct bo *bo)
 	return error;
 }
 
+/*
+ * Closes the handles of the first num_planes planes of a buffer whose import failed. Importing a
+ * dma-buf again returns the handle the first import got, so handles that other buffers hold are
+ * left open.
+ */
+int drv_gem_bo_close_unreferenced(struct bo *bo, size_t num_planes)
+{
+	struct drm_gem_close gem_close;
+	struct drv_shard *shard;
+	int ret, error = 0;
+	size_t plane, i;
+	uint32_t handle;
+
+	for (plane = 0; plane < num_planes; plane++) {
+		handle = bo->handles[plane].u32;
+		for (i = 0; i < plane; i++)
+			if (bo->handles[i].u32 == handle)
+				break;
+
+		if (i != plane)
+			continue;
+
+		shard = &bo->drv->shards[DRV_SHARD(handle)];
+		DRV_LOCK(&shard->lock);
+
+		ret = 0;
+		if (!drv_handle_map_lookup(&shard->handles, handle)) {
+			memset(&gem_close, 0, sizeof(gem_close));
+			gem_close.handle = handle;
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		}
+
+		DRV_UNLOCK(&shard->lock);
+
+		if (ret) {
+			fprintf(stderr, "drv: DRM_IOCTL_GEM_CLOSE failed (handle=%x) error %d\n",
+				handle, ret);
+			error = ret;
+		}
+	}
+
+	return error;
+}
+
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 {
 	int ret;
 	size_t plane;
+	uint32_t shards;
 	struct drm_prime_handle prime_handle;
 
 	for (plane = 0; plane < bo->num_planes; plane++) {
@@ -286,29 +652,42 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 			fprintf(stderr, "drv: DRM_IOCTL_PRIME_FD_TO_HANDLE failed (fd=%u)\n",
 				prime_handle.fd);
 
-			/*
-			 * Need to call GEM close on planes that were opened,
-			 * if any. Adjust the num_planes variable to be the
-			 * plane that failed, so GEM close will be called on
-			 * planes before that plane.
-			 */
-			bo->num_planes = plane;
-			drv_gem_bo_destroy(bo);
+			/* Close the handles of the planes before the one that failed. */
+			drv_gem_bo_close_unreferenced(bo, plane);
 			return ret;
 		}
 
 		bo->handles[plane].u32 = prime_handle.handle;
 	}
 
-	ATOMIC_LOCK(&bo->drv->driver_lock);
-	for (plane = 0; plane < bo->num_planes; plane++) {
-		drv_increment_reference_count(bo->drv, bo, plane);
+	shards = drv_bo_shards(bo);
+	drv_lock_shards(bo->drv, shards);
+	ret = drv_bo_reference_handles(bo->drv, bo);
+	drv_unlock_shards(bo->drv, shards);
+
+	if (ret) {
+		drv_gem_bo_close_unreferenced(bo, bo->num_planes);
+		return ret;
 	}
-	ATOMIC_UNLOCK(&bo->drv->driver_lock);
 
 	return 0;
 }
 
+/* Undoes drv_prime_bo_import(), for backends whose import fails after it succeeded. */
+void drv_prime_bo_unimport(struct bo *bo)
+{
+	size_t plane;
+	uint32_t shards = drv_bo_shards(bo);
+
+	drv_lock_shards(bo->drv, shards);
+	for (plane = 0; plane < bo->num_planes; plane++)
+		if (drv_decrement_reference_count_locked(bo->drv, bo, plane))
+			drv_object_free(bo->drv, bo->records[plane], sizeof(*bo->records[plane]));
+	drv_unlock_shards(bo->drv, shards);
+
+	drv_gem_bo_close_unreferenced(bo, bo->num_planes);
+}
+
 void *drv_dumb_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -332,73 +711,574 @@ void *drv_dumb_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32
 		    map_dumb.offset);
 }
 
+/* Maps the handle of plane by mmap() on its dma-buf, without a driver-specific ioctl. */
+void *drv_dma_buf_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags)
+{
+	int fd;
+	size_t i, length = 0;
+	void *addr;
+
+	fd = drv_bo_get_dma_buf(bo, plane);
+	if (fd < 0)
+		return MAP_FAILED;
+
+	for (i = 0; i < bo->num_planes; i++)
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			length = MAX(length, bo->offsets[i] + bo->sizes[i]);
+
+	addr = mmap(0, length, drv_get_prot(map_flags), MAP_SHARED, fd, 0);
+	if (addr != MAP_FAILED)
+		data->length = length;
+
+	return addr;
+}
+
+/*
+ * Hints the kernel about a new mapping that the CPU will go through in full. Read-only mappings
+ * of buffers read often are read sequentially unless they fit in the map cache, and mappings of
+ * at least min_size bytes of buffers used often are prefaulted. Device memory can't be
+ * populated, so errors are ignored.
+ */
+void drv_bo_advise_map(struct bo *bo, struct map_info *data, size_t min_size)
+{
+	/* Shadow copies are ordinary heap memory, already touched while copying. */
+	if (data->priv || !(bo->use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)))
+		return;
+
+	/*
+	 * Sequential reads drop pages behind them, which a mapping the map cache is going to keep
+	 * would fault back in on every later readback.
+	 */
+	if (!(data->map_flags & BO_MAP_WRITE) && (bo->use_flags & BO_USE_SW_READ_OFTEN) &&
+	    data->length > bo->drv->map_cache_max_size / DRV_LOCK_SHARDS)
+		madvise(data->addr, data->length, MADV_SEQUENTIAL);
+
+	if (data->length < min_size)
+		return;
+
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(data->addr, data->length,
+		     (data->map_flags & BO_MAP_WRITE) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ))
+		return;
+#endif
+
+	/* Older kernels can at least read ahead file-backed buffers. */
+	madvise(data->addr, data->length, MADV_WILLNEED);
+}
+
 int drv_bo_munmap(struct bo *bo, struct map_info *data)
 {
 	return munmap(data->addr, data->length);
 }
 
-int drv_map_info_destroy(struct bo *bo)
+int drv_get_prot(uint32_t map_flags)
+{
+	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
+}
+
+#define HANDLE_MAP_MIN_CAPACITY 16
+
+/*
+ * Fibonacci hashing. The slot comes from the high bits of the product, since the low bits of
+ * the handles in one shard are all the same.
+ */
+static inline uint32_t drv_handle_map_slot(const struct handle_map *map, uint32_t key)
+{
+	return (uint32_t)(key * 2654435769u) >> (32 - __builtin_ctz(map->capacity));
+}
+
+void drv_handle_map_fini(struct handle_map *map)
+{
+	free(map->entries);
+	map->entries = NULL;
+	map->capacity = 0;
+	map->count = 0;
+}
+
+void *drv_handle_map_lookup(const struct handle_map *map, uint32_t key)
+{
+	uint32_t i;
+
+	if (!map->count)
+		return NULL;
+
+	for (i = drv_handle_map_slot(map, key); map->entries[i].key;
+	     i = (i + 1) & (map->capacity - 1))
+		if (map->entries[i].key == key)
+			return map->entries[i].value;
+
+	return NULL;
+}
+
+static int drv_handle_map_resize(struct handle_map *map, uint32_t capacity)
+{
+	uint32_t i, j;
+	struct handle_map_entry *old = map->entries;
+	uint32_t old_capacity = map->capacity;
+
+	map->entries = calloc(capacity, sizeof(*map->entries));
+	if (!map->entries) {
+		map->entries = old;
+		return -ENOMEM;
+	}
+
+	map->capacity = capacity;
+	for (i = 0; i < old_capacity; i++) {
+		if (!old[i].key)
+			continue;
+
+		for (j = drv_handle_map_slot(map, old[i].key); map->entries[j].key;
+		     j = (j + 1) & (capacity - 1))
+			;
+
+		map->entries[j] = old[i];
+	}
+
+	free(old);
+	return 0;
+}
+
+/* Adds a key that must not be in the map yet. The map grows at a load factor of 70%. */
+int drv_handle_map_insert(struct handle_map *map, uint32_t key, void *value)
 {
 	int ret;
-	void *ptr;
-	size_t plane;
-	struct map_info *data;
+	uint32_t i;
+
+	assert(key);
+
+	if ((map->count + 1) * 10 > map->capacity * 7) {
+		ret = drv_handle_map_resize(map, map->capacity ? map->capacity * 2 :
+								 HANDLE_MAP_MIN_CAPACITY);
+		if (ret)
+			return ret;
+	}
+
+	for (i = drv_handle_map_slot(map, key); map->entries[i].key;
+	     i = (i + 1) & (map->capacity - 1))
+		assert(map->entries[i].key != key);
+
+	map->entries[i].key = key;
+	map->entries[i].value = value;
+	map->count++;
+	return 0;
+}
+
+void drv_handle_map_remove(struct handle_map *map, uint32_t key)
+{
+	uint32_t i, j, home, mask = map->capacity - 1;
+
+	if (!map->count)
+		return;
+
+	for (i = drv_handle_map_slot(map, key); map->entries[i].key != key; i = (i + 1) & mask)
+		if (!map->entries[i].key)
+			return;
 
 	/*
-	 * This function is called right before the buffer is destroyed. It will free any mappings
-	 * associated with the buffer.
+	 * Backward shift deletion: move later entries of the cluster into the hole unless that
+	 * would put them before their home slot.
 	 */
+	for (j = (i + 1) & mask; map->entries[j].key; j = (j + 1) & mask) {
+		home = drv_handle_map_slot(map, map->entries[j].key);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			map->entries[i] = map->entries[j];
+			i = j;
+		}
+	}
 
-	for (plane = 0; plane < bo->num_planes; plane++) {
-		if (!drmHashLookup(bo->drv->map_table, bo->handles[plane].u32, &ptr)) {
-			data = (struct map_info *)ptr;
-			ret = bo->drv->backend->bo_unmap(bo, data);
-			if (ret) {
-				fprintf(stderr, "drv: munmap failed");
-				return ret;
-			}
+	map->entries[i].key = 0;
+	map->entries[i].value = NULL;
+	map->count--;
+}
+
+/* Takes record off the idle list, wherever it is. */
+static void drv_map_cache_unlink(struct map_cache *cache, struct handle_record *record)
+{
+	if (record->idle_prev)
+		record->idle_prev->idle_next = record->idle_next;
+	else
+		cache->head = record->idle_next;
+
+	if (record->idle_next)
+		record->idle_next->idle_prev = record->idle_prev;
+	else
+		cache->tail = record->idle_prev;
+
+	record->idle_prev = NULL;
+	record->idle_next = NULL;
+}
+
+static bool drv_map_cache_linked(struct map_cache *cache, struct handle_record *record)
+{
+	return record->idle_prev || cache->head == record;
+}
+
+/* Adds the mapping in slot, which just lost its last user, and makes record the most recent. */
+void drv_map_cache_insert(struct map_cache *cache, struct handle_record *record, uint32_t slot)
+{
+	if (drv_map_cache_linked(cache, record))
+		drv_map_cache_unlink(cache, record);
+
+	record->idle_next = cache->head;
+
+	if (cache->head)
+		cache->head->idle_prev = record;
+	else
+		cache->tail = record;
 
-			drmHashDelete(bo->drv->map_table, data->handle);
-			free(data);
+	cache->head = record;
+	cache->size += record->maps[slot]->length;
+	cache->count++;
+}
+
+/* Removes the idle mapping in slot, and record too unless its other mapping is idle. */
+void drv_map_cache_remove(struct map_cache *cache, struct handle_record *record, uint32_t slot)
+{
+	uint32_t other = slot ^ 1;
+
+	cache->size -= record->maps[slot]->length;
+	cache->count--;
+
+	if (!record->maps[other] || record->maps[other]->refcount)
+		drv_map_cache_unlink(cache, record);
+}
+
+/* Removes record with all its idle mappings, which stay in record->maps for the caller. */
+void drv_map_cache_remove_record(struct map_cache *cache, struct handle_record *record)
+{
+	uint32_t slot;
+
+	for (slot = 0; slot < DRV_MAP_SLOTS; slot++) {
+		if (!record->maps[slot] || record->maps[slot]->refcount)
+			continue;
+
+		cache->size -= record->maps[slot]->length;
+		cache->count--;
+	}
+
+	/* Records whose mappings all have users aren't on the list. */
+	if (drv_map_cache_linked(cache, record))
+		drv_map_cache_unlink(cache, record);
+}
+
+/*
+ * Takes a reference on the handle of a plane, adding a record for the handle if it isn't known
+ * yet. The caller must hold the shard lock of the handle.
+ */
+int drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+{
+	struct handle_record *record;
+	uint32_t handle = bo->handles[plane].u32;
+	struct handle_map *map = &drv->shards[DRV_SHARD(handle)].handles;
+
+	record = drv_handle_map_lookup(map, handle);
+	if (!record) {
+		record = drv_object_alloc(drv, sizeof(*record));
+		if (!record)
+			return -ENOMEM;
+
+		record->handle = handle;
+		atomic_init(&record->dma_buf_fd, -1);
+		if (drv_handle_map_insert(map, handle, record)) {
+			drv_object_free(drv, record, sizeof(*record));
+			return -ENOMEM;
 		}
 	}
 
+	atomic_fetch_add_explicit(&record->refcount, 1, memory_order_relaxed);
+	bo->records[plane] = record;
 	return 0;
 }
 
-int drv_get_prot(uint32_t map_flags)
+/*
+ * Drops the reference a plane holds on its handle, with the shard lock held. Returns true if that
+ * was the last reference, in which case the record has been removed from the handle table and
+ * must be freed by the caller.
+ */
+bool drv_decrement_reference_count_locked(struct driver *drv, struct bo *bo, size_t plane)
 {
-	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
+	struct handle_record *record = bo->records[plane];
+	struct drv_shard *shard = &drv->shards[DRV_SHARD(record->handle)];
+
+	if (atomic_fetch_sub_explicit(&record->refcount, 1, memory_order_acq_rel) != 1)
+		return false;
+
+	/* The caller releases the mappings, which still have users if bo was destroyed mapped. */
+	if (record->maps[0] || record->maps[1])
+		drv_map_cache_remove_record(&shard->maps, record);
+
+	drv_handle_map_remove(&shard->handles, record->handle);
+	return true;
+}
+
+/* Like drv_decrement_reference_count_locked(), but only locks the shard for the last reference. */
+bool drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+{
+	bool last;
+	struct handle_record *record = bo->records[plane];
+	struct drv_shard *shard = &drv->shards[DRV_SHARD(record->handle)];
+	unsigned int count = atomic_load_explicit(&record->refcount, memory_order_relaxed);
+
+	while (count > 1) {
+		if (atomic_compare_exchange_weak_explicit(&record->refcount, &count, count - 1,
+							  memory_order_release,
+							  memory_order_relaxed))
+			return false;
+	}
+
+	DRV_LOCK(&shard->lock);
+	last = drv_decrement_reference_count_locked(drv, bo, plane);
+	DRV_UNLOCK(&shard->lock);
+
+	return last;
 }
 
-uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+/*
+ * Takes a reference on the handles of all planes of bo, or on none of them on failure. The caller
+ * must hold the locks of drv_bo_shards(bo).
+ */
+int drv_bo_reference_handles(struct driver *drv, struct bo *bo)
 {
-	void *count;
-	uintptr_t num = 0;
+	int ret;
+	size_t plane;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		ret = drv_increment_reference_count(drv, bo, plane);
+		if (ret)
+			goto unreference;
+	}
+
+	return 0;
+
+unreference:
+	while (plane--)
+		if (drv_decrement_reference_count_locked(drv, bo, plane))
+			drv_object_free(drv, bo->records[plane], sizeof(*bo->records[plane]));
+
+	return ret;
+}
 
-	if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, &count))
-		num = (uintptr_t)(count);
+/* Number of times a waiter polls the lock word before going to sleep in the kernel. */
+#define DRV_MUTEX_SPIN_COUNT 100
 
-	return num;
+static inline void drv_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield" ::: "memory");
+#endif
 }
 
-void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+void drv_mutex_lock(struct drv_mutex *mutex)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	int i, c = 0;
+
+	/* Uncontended critical sections are a handful of hash operations; spin for those. */
+	for (i = 0; i < DRV_MUTEX_SPIN_COUNT; i++) {
+		c = 0;
+		if (atomic_compare_exchange_weak_explicit(&mutex->state, &c, 1,
+							  memory_order_acquire,
+							  memory_order_relaxed))
+			return;
+
+		drv_cpu_relax();
+	}
+
+	/* Mark the lock contended so that the owner wakes us up on unlock. */
+	if (c != 2)
+		c = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
 
-	/* If a value isn't in the table, drmHashDelete is a no-op */
-	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
-	drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num + 1));
+	while (c != 0) {
+		syscall(SYS_futex, &mutex->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+		c = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+	}
 }
 
-void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+void drv_mutex_unlock(struct drv_mutex *mutex)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	if (atomic_fetch_sub_explicit(&mutex->state, 1, memory_order_release) != 1) {
+		atomic_store_explicit(&mutex->state, 0, memory_order_release);
+		syscall(SYS_futex, &mutex->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+/* Chunks per thread a copy is split into, so that a slow thread doesn't hold up the others. */
+#define DRV_COPY_CHUNKS_PER_THREAD 4
 
-	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
+static void drv_futex_wait(atomic_uint *word, uint32_t value)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
 
-	if (num > 0)
-		drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num - 1));
+static void drv_futex_wake(atomic_uint *word, int count)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void drv_copy_engine_init(struct copy_engine *engine)
+{
+	long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+
+	if (size <= 0)
+		size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+	engine->min_size = DRV_COPY_PARALLEL_MIN_SIZE;
+	engine->stream_min_size = (size > 0) ? (size_t)size : SIZE_MAX;
+}
+
+static void drv_copy_engine_run_chunks(struct copy_engine *engine)
+{
+	uint32_t first;
+
+	while ((first = atomic_fetch_add_explicit(&engine->next, engine->chunk,
+						  memory_order_relaxed)) < engine->count)
+		engine->func(engine->arg, first, MIN(first + engine->chunk, engine->count));
+}
+
+static void *drv_copy_worker(void *arg)
+{
+	struct copy_engine *engine = arg;
+	uint32_t generation, seen = 0;
+
+	for (;;) {
+		generation = atomic_load_explicit(&engine->generation, memory_order_acquire);
+		if (generation == seen) {
+			drv_futex_wait(&engine->generation, seen);
+			continue;
+		}
+
+		seen = generation;
+		if (atomic_load_explicit(&engine->stop, memory_order_relaxed))
+			return NULL;
+
+		drv_copy_engine_run_chunks(engine);
+
+		if (atomic_fetch_sub_explicit(&engine->pending, 1, memory_order_release) == 1)
+			drv_futex_wake(&engine->pending, 1);
+	}
+}
+
+/* Starts a worker per online CPU besides the calling one, leaving signals to other threads. */
+static void drv_copy_engine_start(struct copy_engine *engine)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t i, count = MIN(MAX(cpus, 1), DRV_COPY_MAX_THREADS) - 1;
+	sigset_t all, old;
+
+	engine->started = true;
+	engine->pid = getpid();
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&engine->workers[i], NULL, drv_copy_worker, engine))
+			break;
+
+		engine->num_workers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void drv_copy_engine_fini(struct copy_engine *engine)
+{
+	uint32_t i;
+
+	if (!engine->num_workers || engine->pid != getpid())
+		return;
+
+	atomic_store_explicit(&engine->stop, true, memory_order_relaxed);
+	atomic_fetch_add_explicit(&engine->generation, 1, memory_order_release);
+	drv_futex_wake(&engine->generation, INT_MAX);
+
+	for (i = 0; i < engine->num_workers; i++)
+		pthread_join(engine->workers[i], NULL);
+}
+
+/*
+ * Calls func over [0, count) in chunks, spread across the copy engine's workers when the copy
+ * is at least the engine's minimum size bytes. Returns once every chunk is done.
+ */
+void drv_copy_run(struct driver *drv, drv_copy_func func, void *arg, uint32_t count, size_t size)
+{
+	uint32_t i, pending;
+	struct copy_engine *engine = &drv->copy_engine;
+
+	if (size < engine->min_size || count < 2 ||
+	    atomic_exchange_explicit(&engine->busy, true, memory_order_acquire)) {
+		func(arg, 0, count);
+		return;
+	}
+
+	if (!engine->started)
+		drv_copy_engine_start(engine);
+
+	/* Workers don't survive fork(). */
+	if (!engine->num_workers || engine->pid != getpid()) {
+		func(arg, 0, count);
+		goto out;
+	}
+
+	engine->func = func;
+	engine->arg = arg;
+	engine->count = count;
+	engine->chunk = DIV_ROUND_UP(count, (engine->num_workers + 1) * DRV_COPY_CHUNKS_PER_THREAD);
+	atomic_store_explicit(&engine->next, 0, memory_order_relaxed);
+	atomic_store_explicit(&engine->pending, engine->num_workers, memory_order_relaxed);
+	atomic_fetch_add_explicit(&engine->generation, 1, memory_order_release);
+	drv_futex_wake(&engine->generation, INT_MAX);
+
+	drv_copy_engine_run_chunks(engine);
+
+	/* Workers usually finish their last chunk around the same time as we do. */
+	for (i = 0; i < DRV_MUTEX_SPIN_COUNT; i++) {
+		if (!atomic_load_explicit(&engine->pending, memory_order_acquire))
+			goto out;
+
+		drv_cpu_relax();
+	}
+
+	while ((pending = atomic_load_explicit(&engine->pending, memory_order_acquire)))
+		drv_futex_wait(&engine->pending, pending);
+
+out:
+	atomic_store_explicit(&engine->busy, false, memory_order_release);
+}
+
+/* Returns the mask of table shards the handles of bo live in. */
+uint32_t drv_bo_shards(struct bo *bo)
+{
+	size_t plane;
+	uint32_t shards = 0;
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		shards |= 1u << DRV_SHARD(bo->handles[plane].u32);
+
+	return shards;
+}
+
+/*
+ * Locks every shard in the mask. Shards are always taken in ascending order, so holders of
+ * overlapping masks can't deadlock.
+ */
+void drv_lock_shards(struct driver *drv, uint32_t shards)
+{
+	uint32_t i;
+
+	for (i = 0; i < DRV_LOCK_SHARDS; i++)
+		if (shards & (1u << i))
+			DRV_LOCK(&drv->shards[i].lock);
+}
+
+void drv_unlock_shards(struct driver *drv, uint32_t shards)
+{
+	uint32_t i;
+
+	for (i = DRV_LOCK_SHARDS; i-- > 0;)
+		if (shards & (1u << i))
+			DRV_UNLOCK(&drv->shards[i].lock);
 }
 
 uint32_t drv_log_base2(uint32_t value)
@@ -431,6 +1311,9 @@ int drv_add_combination(struct driver *drv, uint32_t format, struct format_metad
 	combos->data[combos->size].metadata.modifier = metadata->modifier;
 	combos->data[combos->size].use_flags = use_flags;
 	combos->size++;
+
+	/* The new entry isn't covered by the index until it is rebuilt. */
+	combos->generation = 0;
 	return 0;
 }
 
@@ -460,6 +1343,65 @@ void drv_modify_combination(struct driver *drv, uint32_t format, struct format_m
 		    combo->metadata.modifier == metadata->modifier)
 			combo->use_flags |= use_flags;
 	}
+
+	/* The index only stores positions, but memoized lookups depend on the flags. */
+	if (drv->combos.generation)
+		drv->combos.generation = atomic_fetch_add(&combination_generation, 1) + 1;
+}
+
+static bool combination_precedes(const struct combination *a, const struct combination *b)
+{
+	if (a->format != b->format)
+		return a->format < b->format;
+
+	return a->metadata.priority > b->metadata.priority;
+}
+
+/*
+ * Sorts the combinations by format and then by descending priority, and records where each
+ * format's entries start. drv_get_combination() can then binary search the format and return
+ * the first entry whose use flags match. The sort is stable, so entries of equal priority keep
+ * the order in which the backend added them.
+ */
+int drv_index_combinations(struct driver *drv)
+{
+	struct combination tmp;
+	struct combination_range *ranges;
+	struct combinations *combos = &drv->combos;
+	uint32_t i, j, num_ranges = 0;
+
+	for (i = 1; i < combos->size; i++) {
+		tmp = combos->data[i];
+		for (j = i; j > 0 && combination_precedes(&tmp, &combos->data[j - 1]); j--)
+			combos->data[j] = combos->data[j - 1];
+
+		combos->data[j] = tmp;
+	}
+
+	for (i = 0; i < combos->size; i++)
+		if (i == 0 || combos->data[i].format != combos->data[i - 1].format)
+			num_ranges++;
+
+	ranges = realloc(combos->ranges, MAX(num_ranges, 1) * sizeof(*ranges));
+	if (!ranges)
+		return -ENOMEM;
+
+	num_ranges = 0;
+	for (i = 0; i < combos->size; i++) {
+		if (i == 0 || combos->data[i].format != combos->data[i - 1].format) {
+			ranges[num_ranges].format = combos->data[i].format;
+			ranges[num_ranges].first = i;
+			ranges[num_ranges].count = 0;
+			num_ranges++;
+		}
+
+		ranges[num_ranges - 1].count++;
+	}
+
+	combos->ranges = ranges;
+	combos->num_ranges = num_ranges;
+	combos->generation = atomic_fetch_add(&combination_generation, 1) + 1;
+	return 0;
 }
 
 struct kms_item *drv_query_kms(struct driver *drv, uint32_t *num_items)
@@ -7,23 +7,54 @@
 #ifndef HELPERS_H
 #define HELPERS_H
 
+#include <stdbool.h>
+
 #include "drv.h"
 
+const struct format_desc *drv_get_format_desc(uint32_t format);
 uint32_t drv_stride_from_format(uint32_t format, uint32_t width, size_t plane);
 uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane);
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height, uint32_t format);
+void drv_bo_plane_region(struct bo *bo, size_t plane, const struct rectangle *rect, size_t *offset,
+			 size_t *row_bytes, uint32_t *rows);
+void drv_copy_engine_init(struct copy_engine *engine);
+void drv_copy_engine_fini(struct copy_engine *engine);
+void drv_copy_run(struct driver *drv, drv_copy_func func, void *arg, uint32_t count, size_t size);
+void drv_bo_copy_region(struct bo *bo, uint8_t *dst, const uint8_t *src,
+			const struct rectangle *rect);
+void drv_copy_from_map(struct map_info *data, uint8_t *dst, const uint8_t *src, size_t size);
+int drv_bo_get_dma_buf(struct bo *bo, size_t plane);
+void *drv_bo_get_shadow(struct bo *bo, size_t plane, uint32_t map_flags, size_t size);
+int drv_dma_buf_invalidate(struct bo *bo, struct map_info *data, const struct rectangle *rect);
+int drv_dma_buf_flush(struct bo *bo, struct map_info *data, const struct rectangle *rect);
 int drv_dumb_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 		       uint64_t use_flags);
 int drv_dumb_bo_destroy(struct bo *bo);
 int drv_gem_bo_destroy(struct bo *bo);
+int drv_gem_bo_close_unreferenced(struct bo *bo, size_t num_planes);
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data);
+void drv_prime_bo_unimport(struct bo *bo);
 void *drv_dumb_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags);
+void *drv_dma_buf_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags);
+void drv_bo_advise_map(struct bo *bo, struct map_info *data, size_t min_size);
 int drv_bo_munmap(struct bo *bo, struct map_info *data);
-int drv_map_info_destroy(struct bo *bo);
 int drv_get_prot(uint32_t map_flags);
-uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane);
-void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane);
-void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+void drv_handle_map_fini(struct handle_map *map);
+void *drv_handle_map_lookup(const struct handle_map *map, uint32_t key);
+int drv_handle_map_insert(struct handle_map *map, uint32_t key, void *value);
+void drv_handle_map_remove(struct handle_map *map, uint32_t key);
+void drv_map_cache_insert(struct map_cache *cache, struct handle_record *record, uint32_t slot);
+void drv_map_cache_remove(struct map_cache *cache, struct handle_record *record, uint32_t slot);
+void drv_map_cache_remove_record(struct map_cache *cache, struct handle_record *record);
+int drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+bool drv_decrement_reference_count_locked(struct driver *drv, struct bo *bo, size_t plane);
+bool drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+int drv_bo_reference_handles(struct driver *drv, struct bo *bo);
+void drv_mutex_lock(struct drv_mutex *mutex);
+void drv_mutex_unlock(struct drv_mutex *mutex);
+uint32_t drv_bo_shards(struct bo *bo);
+void drv_lock_shards(struct driver *drv, uint32_t shards);
+void drv_unlock_shards(struct driver *drv, uint32_t shards);
 uint32_t drv_log_base2(uint32_t value);
 int drv_add_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			uint64_t usage);
@@ -31,6 +62,7 @@ int drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t n
 			 struct format_metadata *metadata, uint64_t usage);
 void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			    uint64_t usage);
+int drv_index_combinations(struct driver *drv);
 struct kms_item *drv_query_kms(struct driver *drv, uint32_t *num_items);
 int drv_modify_linear_combinations(struct driver *drv);
 uint64_t drv_pick_modifier(const uint64_t *modifiers, uint32_t count,
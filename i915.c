@@ -6,6 +6,7 @@
 
 #ifdef DRV_I915
 
+#include <cpuid.h>
 #include <errno.h>
 #include <i915_drm.h>
 #include <stdio.h>
@@ -34,12 +35,20 @@ static const uint32_t tileable_texture_source_formats[] = { DRM_FORMAT_GR88, DRM
 static const uint32_t texture_source_formats[] = { DRM_FORMAT_YVU420, DRM_FORMAT_YVU420_ANDROID,
 						   DRM_FORMAT_NV12 };
 
+/* Instructions for writing back CPU caches, best last. */
+enum i915_flush_method {
+	I915_FLUSH_CLFLUSH,
+	I915_FLUSH_CLFLUSHOPT,
+	I915_FLUSH_CLWB,
+};
+
 struct i915_device
 {
 	uint32_t gen;
 	int32_t has_llc;
 	uint64_t cursor_width;
 	uint64_t cursor_height;
+	enum i915_flush_method flush_method;
 };
 
 static uint32_t i915_get_gen(int device_id)
@@ -256,18 +265,84 @@ static int i915_align_dimensions(struct bo *bo, uint32_t tiling, uint64_t modifi
 	return 0;
 }
 
+static bool i915_flush_method_supported(enum i915_flush_method method)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	if (method == I915_FLUSH_CLFLUSH)
+		return true;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return ebx & (method == I915_FLUSH_CLWB ? bit_CLWB : bit_CLFLUSHOPT);
+}
+
+static enum i915_flush_method i915_get_flush_method(void)
+{
+	if (i915_flush_method_supported(I915_FLUSH_CLWB))
+		return I915_FLUSH_CLWB;
+
+	if (i915_flush_method_supported(I915_FLUSH_CLFLUSHOPT))
+		return I915_FLUSH_CLFLUSHOPT;
+
+	return I915_FLUSH_CLFLUSH;
+}
+
 static void i915_clflush(void *start, size_t size)
 {
 	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
 	void *end = (void *)((uintptr_t)start + size);
 
-	__builtin_ia32_mfence();
 	while (p < end) {
 		__builtin_ia32_clflush(p);
 		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
 	}
 }
 
+__attribute__((target("clflushopt"))) static void i915_clflushopt(void *start, size_t size)
+{
+	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
+	void *end = (void *)((uintptr_t)start + size);
+
+	while (p < end) {
+		__builtin_ia32_clflushopt(p);
+		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+	}
+}
+
+__attribute__((target("clwb"))) static void i915_clwb(void *start, size_t size)
+{
+	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
+	void *end = (void *)((uintptr_t)start + size);
+
+	while (p < end) {
+		__builtin_ia32_clwb(p);
+		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+	}
+}
+
+static void i915_flush_range(struct i915_device *i915, void *start, size_t size)
+{
+	switch (i915->flush_method) {
+	case I915_FLUSH_CLWB:
+		i915_clwb(start, size);
+		break;
+	case I915_FLUSH_CLFLUSHOPT:
+		i915_clflushopt(start, size);
+		break;
+	default:
+		i915_clflush(start, size);
+		break;
+	}
+}
+
+/* Scanout buffers that the CPU only writes are mapped write-combined, bypassing the caches. */
+static bool i915_bo_map_is_wc(struct bo *bo)
+{
+	return (bo->use_flags & BO_USE_SCANOUT) && !(bo->use_flags & BO_USE_RENDERSCRIPT);
+}
+
 static int i915_init(struct driver *drv)
 {
 	int ret;
@@ -290,6 +365,7 @@ static int i915_init(struct driver *drv)
 	}
 
 	i915->gen = i915_get_gen(device_id);
+	i915->flush_method = i915_get_flush_method();
 
 	memset(&get_param, 0, sizeof(get_param));
 	get_param.param = I915_PARAM_HAS_LLC;
@@ -308,14 +384,11 @@ static int i915_init(struct driver *drv)
 	return i915_add_combinations(drv);
 }
 
-static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
-				       uint32_t format, uint64_t modifier)
+static int i915_bo_compute_layout_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
+					       uint32_t format, uint64_t modifier)
 {
 	int ret;
-	size_t plane;
 	uint32_t stride;
-	struct drm_i915_gem_create gem_create;
-	struct drm_i915_gem_set_tiling gem_set_tiling;
 	struct i915_device *i915_dev = (struct i915_device *)bo->drv->priv;
 
 	switch (modifier) {
@@ -427,6 +500,16 @@ static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t h
         bo->width = width;
         bo->height = height;
 
+	return 0;
+}
+
+static int i915_bo_create_from_layout(struct bo *bo)
+{
+	int ret;
+	size_t plane;
+	struct drm_i915_gem_create gem_create;
+	struct drm_i915_gem_set_tiling gem_set_tiling;
+
 	memset(&gem_create, 0, sizeof(gem_create));
 	gem_create.size = bo->total_size;
 
@@ -459,8 +542,20 @@ static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t h
 	return 0;
 }
 
-static int i915_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-			  uint64_t use_flags)
+static int i915_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
+				       uint32_t format, uint64_t modifier)
+{
+	int ret;
+
+	ret = i915_bo_compute_layout_for_modifier(bo, width, height, format, modifier);
+	if (ret)
+		return ret;
+
+	return i915_bo_create_from_layout(bo);
+}
+
+static int i915_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height,
+				  uint32_t format, uint64_t use_flags)
 {
 	struct combination *combo;
 
@@ -468,7 +563,23 @@ static int i915_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32
 	if (!combo)
 		return -EINVAL;
 
-	return i915_bo_create_for_modifier(bo, width, height, format, combo->metadata.modifier);
+	bo->format_modifiers[0] = combo->metadata.modifier;
+
+	return i915_bo_compute_layout_for_modifier(bo, width, height, format,
+						   combo->metadata.modifier);
+}
+
+/* Same as the layout query, so that batches and single buffers get identical buffers. */
+static int i915_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			  uint64_t use_flags)
+{
+	int ret;
+
+	ret = i915_bo_compute_layout(bo, width, height, format, use_flags);
+	if (ret)
+		return ret;
+
+	return i915_bo_create_from_layout(bo);
 }
 
 static int i915_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
@@ -526,7 +637,7 @@ static void *i915_bo_map(struct bo *bo, struct map_info *data, size_t plane, uin
 		struct drm_i915_gem_mmap gem_map;
 		memset(&gem_map, 0, sizeof(gem_map));
 
-		if ((bo->use_flags & BO_USE_SCANOUT) && !(bo->use_flags & BO_USE_RENDERSCRIPT))
+		if (i915_bo_map_is_wc(bo))
 			gem_map.flags = I915_MMAP_WC;
 
 		gem_map.handle = bo->handles[0].u32;
@@ -562,13 +673,52 @@ static void *i915_bo_map(struct bo *bo, struct map_info *data, size_t plane, uin
 	}
 
 	data->length = bo->total_size;
+	/* GTT mappings go through the aperture, which is write-combined too. */
+	data->write_combined = bo->tiling != I915_TILING_NONE || i915_bo_map_is_wc(bo);
 	return addr;
 }
 
-static int i915_bo_invalidate(struct bo *bo, struct map_info *data)
+/* GEM_WAIT can't tell reads from writes, so CPU reads also wait for GPU reads. */
+static int i915_bo_wait(struct bo *bo, uint32_t map_flags, int timeout_ms)
+{
+	int ret;
+	struct drm_i915_gem_wait gem_wait;
+
+	/* A zero timeout only checks whether the buffer is busy. */
+	memset(&gem_wait, 0, sizeof(gem_wait));
+	gem_wait.bo_handle = bo->handles[0].u32;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_WAIT, &gem_wait);
+	if (!ret)
+		return 1;
+
+	if (errno != ETIME) {
+		fprintf(stderr, "drv: DRM_IOCTL_I915_GEM_WAIT failed with %d\n", errno);
+		return -errno;
+	}
+
+	if (!timeout_ms)
+		return -ETIME;
+
+	/* The kernel waits without limit for a negative timeout. */
+	gem_wait.timeout_ns = (timeout_ms < 0) ? -1 : (int64_t)timeout_ms * 1000000;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_WAIT, &gem_wait);
+	if (ret)
+		return -errno;
+
+	return 0;
+}
+
+/* Packs the domains of a set_domain request for handle_record.domains. */
+#define I915_DOMAINS(read_domains, write_domain) ((read_domains) | (write_domain) << 16)
+
+static int i915_bo_invalidate(struct bo *bo, struct map_info *data, const struct rectangle *rect)
 {
 	int ret;
+	uint32_t domains, current;
 	struct drm_i915_gem_set_domain set_domain;
+	struct handle_record *record = bo->records[0];
 
 	memset(&set_domain, 0, sizeof(set_domain));
 	set_domain.handle = bo->handles[0].u32;
@@ -582,20 +732,60 @@ static int i915_bo_invalidate(struct bo *bo, struct map_info *data)
 			set_domain.write_domain = I915_GEM_DOMAIN_GTT;
 	}
 
+	/*
+	 * Only the GPU can move a buffer out of the domain set last. The domains are forgotten
+	 * when CPU access ends with a flush and when the handle is handed out, so only repeated
+	 * invalidates within one span of CPU access are skipped.
+	 */
+	domains = I915_DOMAINS(set_domain.read_domains, set_domain.write_domain);
+	current = atomic_load_explicit(&record->domains, memory_order_relaxed);
+	if (current == domains || current == (domains | I915_DOMAINS(0, set_domain.read_domains)))
+		return 0;
+
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
 	if (ret) {
 		fprintf(stderr, "drv: DRM_IOCTL_I915_GEM_SET_DOMAIN with %d\n", ret);
 		return ret;
 	}
 
+	atomic_store_explicit(&record->domains, domains, memory_order_relaxed);
 	return 0;
 }
 
-static int i915_bo_flush(struct bo *bo, struct map_info *data)
+static int i915_bo_flush(struct bo *bo, struct map_info *data, const struct rectangle *rect)
 {
+	size_t plane, offset, row_bytes;
+	uint32_t row, rows;
+	uint8_t *addr = data->addr;
 	struct i915_device *i915 = bo->drv->priv;
-	if (!i915->has_llc && bo->tiling == I915_TILING_NONE)
-		i915_clflush(data->addr, data->length);
+
+	/* The GPU may use the buffer once CPU access ends. */
+	atomic_store_explicit(&bo->records[0]->domains, 0, memory_order_relaxed);
+
+	if (i915->has_llc || bo->tiling != I915_TILING_NONE || i915_bo_map_is_wc(bo))
+		return 0;
+
+	/*
+	 * clflush is ordered with all earlier stores. clflushopt and clwb are only ordered with
+	 * stores to the same line, and need a fence to complete before the GPU is told to read.
+	 */
+	if (i915->flush_method == I915_FLUSH_CLFLUSH)
+		__builtin_ia32_mfence();
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		drv_bo_plane_region(bo, plane, rect, &offset, &row_bytes, &rows);
+
+		if (row_bytes == bo->strides[plane]) {
+			i915_flush_range(i915, addr + offset, row_bytes * rows);
+			continue;
+		}
+
+		for (row = 0; row < rows; row++, offset += bo->strides[plane])
+			i915_flush_range(i915, addr + offset, row_bytes);
+	}
+
+	if (i915->flush_method != I915_FLUSH_CLFLUSH)
+		__builtin_ia32_sfence();
 
 	return 0;
 }
@@ -632,14 +822,18 @@ static uint32_t i915_resolve_format(uint32_t format, uint64_t use_flags)
 
 struct backend backend_i915 = {
 	.name = "i915",
+	.flags = BACKEND_INVALIDATE_WAITS,
 	.init = i915_init,
 	.close = i915_close,
 	.bo_create = i915_bo_create,
 	.bo_create_with_modifiers = i915_bo_create_with_modifiers,
+	.bo_compute_layout = i915_bo_compute_layout,
+	.bo_create_from_layout = i915_bo_create_from_layout,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = i915_bo_import,
 	.bo_map = i915_bo_map,
 	.bo_unmap = drv_bo_munmap,
+	.bo_wait = i915_bo_wait,
 	.bo_invalidate = i915_bo_invalidate,
 	.bo_flush = i915_bo_flush,
 	.resolve_format = i915_resolve_format,
@@ -150,67 +150,6 @@ void i915_private_align_dimensions(uint32_t format, uint32_t *vertical_alignment
 	}
 }
 
-uint32_t i915_private_bpp_from_format(uint32_t format, size_t plane)
-{
-	assert(plane < drv_num_planes_from_format(format));
-
-	switch (format) {
-	case DRM_FORMAT_NV12_Y_TILED_INTEL:
-		return (plane == 0) ? 8 : 4;
-	case DRM_FORMAT_P010:
-		return (plane == 0) ? 16 : 8;
-	case DRM_FORMAT_YUV420:
-	case DRM_FORMAT_YUV422:
-	case DRM_FORMAT_YUV444:
-	case DRM_FORMAT_NV16:
-		return 8;
-	case DRM_FORMAT_R16:
-		return 16;
-	case DRM_FORMAT_ABGR2101010:
-		return 32;
-	case DRM_FORMAT_ABGR16161616F:
-		return 64;
-	}
-
-	fprintf(stderr, "drv: UNKNOWN FORMAT %d\n", format);
-	return 0;
-}
-
-void i915_private_vertical_subsampling_from_format(uint32_t *vertical_subsampling, uint32_t format,
-						   size_t plane)
-{
-	switch (format) {
-	case DRM_FORMAT_NV12_Y_TILED_INTEL:
-	case DRM_FORMAT_YUV420:
-	case DRM_FORMAT_P010:
-		*vertical_subsampling = (plane == 0) ? 1 : 2;
-		break;
-	default:
-		*vertical_subsampling = 1;
-	}
-}
-
-size_t i915_private_num_planes_from_format(uint32_t format)
-{
-	switch (format) {
-	case DRM_FORMAT_R16:
-	case DRM_FORMAT_ABGR2101010:
-	case DRM_FORMAT_ABGR16161616F:
-		return 1;
-	case DRM_FORMAT_NV12_Y_TILED_INTEL:
-	case DRM_FORMAT_NV16:
-	case DRM_FORMAT_P010:
-		return 2;
-	case DRM_FORMAT_YUV420:
-	case DRM_FORMAT_YUV422:
-	case DRM_FORMAT_YUV444:
-		return 3;
-	}
-
-	fprintf(stderr, "drv: UNKNOWN FORMAT %d\n", format);
-	return 0;
-}
-
 uint32_t i915_private_resolve_format(uint32_t format, uint64_t usage, uint32_t *resolved_format)
 {
 	switch (format) {
@@ -44,13 +44,6 @@ int i915_private_add_combinations(struct driver *drv);
 
 void i915_private_align_dimensions(uint32_t format, uint32_t *vertical_alignment);
 
-uint32_t i915_private_bpp_from_format(uint32_t format, size_t plane);
-
-void i915_private_vertical_subsampling_from_format(uint32_t *vertical_subsampling, uint32_t format,
-						   size_t plane);
-
-size_t i915_private_num_planes_from_format(uint32_t format);
-
 uint32_t i915_private_resolve_format(uint32_t format, uint64_t usage, uint32_t *resolved_format);
 
 #endif
@@ -46,13 +46,10 @@ static int mediatek_init(struct driver *drv)
 	return drv_modify_linear_combinations(drv);
 }
 
-static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-			      uint64_t use_flags)
+static int mediatek_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height,
+				      uint32_t format, uint64_t use_flags)
 {
-	int ret;
-	size_t plane;
 	uint32_t stride;
-	struct drm_mtk_gem_create gem_create;
 
 	/*
 	 * Since the ARM L1 cache line size is 64 bytes, align to that as a
@@ -62,6 +59,15 @@ static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 	stride = ALIGN(stride, 64);
 	drv_bo_from_format(bo, stride, height, format);
 
+	return 0;
+}
+
+static int mediatek_bo_create_from_layout(struct bo *bo)
+{
+	int ret;
+	size_t plane;
+	struct drm_mtk_gem_create gem_create;
+
 	memset(&gem_create, 0, sizeof(gem_create));
 	gem_create.size = bo->total_size;
 
@@ -78,6 +84,18 @@ static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 	return 0;
 }
 
+static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			      uint64_t use_flags)
+{
+	int ret;
+
+	ret = mediatek_bo_compute_layout(bo, width, height, format, use_flags);
+	if (ret)
+		return ret;
+
+	return mediatek_bo_create_from_layout(bo);
+}
+
 static void *mediatek_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -98,24 +116,48 @@ static void *mediatek_bo_map(struct bo *bo, struct map_info *data, size_t plane,
 
 	data->length = bo->total_size;
 
-	if (bo->use_flags & BO_USE_RENDERSCRIPT) {
-		priv = calloc(1, sizeof(*priv));
-		priv->cached_addr = calloc(1, bo->total_size);
+	if (bo->use_flags & BO_USE_RENDERSCRIPT && addr != MAP_FAILED) {
+		/*
+		 * The CPU copy goes away with the mapping, as mappings with private data aren't
+		 * cached. It starts out as the whole buffer so that no flush writes back bytes
+		 * the buffer didn't hold; mediatek_bo_invalidate() refreshes the mapped region.
+		 */
+		priv = malloc(sizeof(*priv) + bo->total_size);
+		if (!priv) {
+			munmap(addr, bo->total_size);
+			return MAP_FAILED;
+		}
+
 		priv->gem_addr = addr;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->total_size);
+		priv->cached_addr = priv + 1;
+		memcpy(priv->cached_addr, addr, bo->total_size);
+
 		data->priv = priv;
 		addr = priv->cached_addr;
 	}
 
+	/* GEM mappings are write-combined, the CPU copy above isn't. */
+	data->write_combined = !data->priv;
 	return addr;
 }
 
+static int mediatek_bo_invalidate(struct bo *bo, struct map_info *data,
+				 const struct rectangle *rect)
+{
+	struct mediatek_private_map_data *priv = data->priv;
+
+	/* Write-only users too, as flushes write back the rows they left alone. */
+	if (priv)
+		drv_bo_copy_region(bo, priv->cached_addr, priv->gem_addr, rect);
+
+	return 0;
+}
+
 static int mediatek_bo_unmap(struct bo *bo, struct map_info *data)
 {
 	if (data->priv) {
 		struct mediatek_private_map_data *priv = data->priv;
 		data->addr = priv->gem_addr;
-		free(priv->cached_addr);
 		free(priv);
 		data->priv = NULL;
 	}
@@ -123,11 +165,11 @@ static int mediatek_bo_unmap(struct bo *bo, struct map_info *data)
 	return munmap(data->addr, data->length);
 }
 
-static int mediatek_bo_flush(struct bo *bo, struct map_info *data)
+static int mediatek_bo_flush(struct bo *bo, struct map_info *data, const struct rectangle *rect)
 {
 	struct mediatek_private_map_data *priv = data->priv;
 	if (priv && (data->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->total_size);
+		drv_bo_copy_region(bo, priv->gem_addr, priv->cached_addr, rect);
 
 	return 0;
 }
@@ -149,10 +191,13 @@ struct backend backend_mediatek = {
 	.name = "mediatek",
 	.init = mediatek_init,
 	.bo_create = mediatek_bo_create,
+	.bo_compute_layout = mediatek_bo_compute_layout,
+	.bo_create_from_layout = mediatek_bo_create_from_layout,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = drv_prime_bo_import,
 	.bo_map = mediatek_bo_map,
 	.bo_unmap = mediatek_bo_unmap,
+	.bo_invalidate = mediatek_bo_invalidate,
 	.bo_flush = mediatek_bo_flush,
 	.resolve_format = mediatek_resolve_format,
 };
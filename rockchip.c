@@ -169,14 +169,10 @@ static bool has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier
 	return false;
 }
 
-static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
+static int rockchip_bo_layout_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
 					     uint32_t format, const uint64_t *modifiers,
 					     uint32_t count)
 {
-	int ret;
-	size_t plane;
-	struct drm_rockchip_gem_create gem_create;
-
 	if (format == DRM_FORMAT_NV12) {
 		uint32_t w_mbs = DIV_ROUND_UP(ALIGN(width, 16), 16);
 		uint32_t h_mbs = DIV_ROUND_UP(ALIGN(height, 16), 16);
@@ -214,6 +210,15 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 		drv_bo_from_format(bo, stride, height, format);
 	}
 
+	return 0;
+}
+
+static int rockchip_bo_create_from_layout(struct bo *bo)
+{
+	int ret;
+	size_t plane;
+	struct drm_rockchip_gem_create gem_create;
+
 	memset(&gem_create, 0, sizeof(gem_create));
 	gem_create.size = bo->total_size;
 
@@ -231,6 +236,19 @@ static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint
 	return 0;
 }
 
+static int rockchip_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
+					     uint32_t format, const uint64_t *modifiers,
+					     uint32_t count)
+{
+	int ret;
+
+	ret = rockchip_bo_layout_with_modifiers(bo, width, height, format, modifiers, count);
+	if (ret)
+		return ret;
+
+	return rockchip_bo_create_from_layout(bo);
+}
+
 static int rockchip_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			      uint64_t use_flags)
 {
@@ -239,6 +257,14 @@ static int rockchip_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
+static int rockchip_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height,
+				      uint32_t format, uint64_t use_flags)
+{
+	uint64_t modifiers[] = { DRM_FORMAT_MOD_LINEAR };
+	return rockchip_bo_layout_with_modifiers(bo, width, height, format, modifiers,
+						 ARRAY_SIZE(modifiers));
+}
+
 static void *rockchip_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -264,24 +290,48 @@ static void *rockchip_bo_map(struct bo *bo, struct map_info *data, size_t plane,
 
 	data->length = bo->total_size;
 
-	if (bo->use_flags & BO_USE_RENDERSCRIPT) {
-		priv = calloc(1, sizeof(*priv));
-		priv->cached_addr = calloc(1, bo->total_size);
+	if (bo->use_flags & BO_USE_RENDERSCRIPT && addr != MAP_FAILED) {
+		/*
+		 * The CPU copy goes away with the mapping, as mappings with private data aren't
+		 * cached. It starts out as the whole buffer so that no flush writes back bytes
+		 * the buffer didn't hold; rockchip_bo_invalidate() refreshes the mapped region.
+		 */
+		priv = malloc(sizeof(*priv) + bo->total_size);
+		if (!priv) {
+			munmap(addr, bo->total_size);
+			return MAP_FAILED;
+		}
+
 		priv->gem_addr = addr;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->total_size);
+		priv->cached_addr = priv + 1;
+		memcpy(priv->cached_addr, addr, bo->total_size);
+
 		data->priv = priv;
 		addr = priv->cached_addr;
 	}
 
+	/* GEM mappings are write-combined, the CPU copy above isn't. */
+	data->write_combined = !data->priv;
 	return addr;
 }
 
+static int rockchip_bo_invalidate(struct bo *bo, struct map_info *data,
+				 const struct rectangle *rect)
+{
+	struct rockchip_private_map_data *priv = data->priv;
+
+	/* Write-only users too, as flushes write back the rows they left alone. */
+	if (priv)
+		drv_bo_copy_region(bo, priv->cached_addr, priv->gem_addr, rect);
+
+	return 0;
+}
+
 static int rockchip_bo_unmap(struct bo *bo, struct map_info *data)
 {
 	if (data->priv) {
 		struct rockchip_private_map_data *priv = data->priv;
 		data->addr = priv->gem_addr;
-		free(priv->cached_addr);
 		free(priv);
 		data->priv = NULL;
 	}
@@ -289,11 +339,11 @@ static int rockchip_bo_unmap(struct bo *bo, struct map_info *data)
 	return munmap(data->addr, data->length);
 }
 
-static int rockchip_bo_flush(struct bo *bo, struct map_info *data)
+static int rockchip_bo_flush(struct bo *bo, struct map_info *data, const struct rectangle *rect)
 {
 	struct rockchip_private_map_data *priv = data->priv;
 	if (priv && (data->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->total_size);
+		drv_bo_copy_region(bo, priv->gem_addr, priv->cached_addr, rect);
 
 	return 0;
 }
@@ -319,10 +369,13 @@ struct backend backend_rockchip = {
 	.init = rockchip_init,
 	.bo_create = rockchip_bo_create,
 	.bo_create_with_modifiers = rockchip_bo_create_with_modifiers,
+	.bo_compute_layout = rockchip_bo_compute_layout,
+	.bo_create_from_layout = rockchip_bo_create_from_layout,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = drv_prime_bo_import,
 	.bo_map = rockchip_bo_map,
 	.bo_unmap = rockchip_bo_unmap,
+	.bo_invalidate = rockchip_bo_invalidate,
 	.bo_flush = rockchip_bo_flush,
 	.resolve_format = rockchip_resolve_format,
 };
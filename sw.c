@@ -0,0 +1,271 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifdef DRV_SW
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/udmabuf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "drv_priv.h"
+#include "helpers.h"
+#include "util.h"
+
+/*
+ * Software backend for hosts without a GPU. Buffers are memfds, wrapped in udmabuf dma-bufs
+ * when /dev/udmabuf is available, and a buffer's handle is its fd.
+ */
+
+static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
+						  DRM_FORMAT_RGB565, DRM_FORMAT_XBGR8888,
+						  DRM_FORMAT_XRGB8888 };
+
+static const uint32_t texture_source_formats[] = { DRM_FORMAT_GR88, DRM_FORMAT_NV12,
+						   DRM_FORMAT_NV21, DRM_FORMAT_R8,
+						   DRM_FORMAT_YVU420, DRM_FORMAT_YVU420_ANDROID };
+
+struct sw_device {
+	int udmabuf_fd;
+};
+
+/* Moves fd above 0, which the buffer table reserves for empty slots. */
+static int sw_handle_from_fd(int fd)
+{
+	int handle;
+
+	if (fd != 0)
+		return fd;
+
+	handle = fcntl(fd, F_DUPFD_CLOEXEC, 1);
+	close(fd);
+	return handle;
+}
+
+static int sw_init(struct driver *drv)
+{
+	int ret;
+	struct sw_device *sw;
+
+	sw = calloc(1, sizeof(*sw));
+	if (!sw)
+		return -ENOMEM;
+
+	sw->udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	drv->priv = sw;
+
+	ret = drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
+				   &LINEAR_METADATA, BO_USE_RENDER_MASK);
+	if (ret)
+		return ret;
+
+	return drv_add_combinations(drv, texture_source_formats, ARRAY_SIZE(texture_source_formats),
+				    &LINEAR_METADATA, BO_USE_TEXTURE_MASK);
+}
+
+static void sw_close(struct driver *drv)
+{
+	struct sw_device *sw = drv->priv;
+
+	if (sw->udmabuf_fd >= 0)
+		close(sw->udmabuf_fd);
+
+	free(sw);
+	drv->priv = NULL;
+}
+
+static int sw_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+				uint64_t use_flags)
+{
+	uint32_t stride;
+
+	/* Align rows to the cache line size, so that CPU renderers can work on whole lines. */
+	stride = drv_stride_from_format(format, width, 0);
+	stride = ALIGN(stride, 64);
+	drv_bo_from_format(bo, stride, height, format);
+
+	return 0;
+}
+
+/* Wraps memfd in a dma-buf, taking ownership of memfd. Returns memfd if that isn't possible. */
+static int sw_export_udmabuf(struct sw_device *sw, int memfd, size_t size)
+{
+	int fd;
+	struct udmabuf_create create;
+
+	if (sw->udmabuf_fd < 0)
+		return memfd;
+
+	if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+		return memfd;
+
+	memset(&create, 0, sizeof(create));
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+
+	fd = ioctl(sw->udmabuf_fd, UDMABUF_CREATE, &create);
+	if (fd < 0)
+		return memfd;
+
+	/* The dma-buf holds its own reference to the pages. */
+	close(memfd);
+	return fd;
+}
+
+static int sw_bo_create_from_layout(struct bo *bo)
+{
+	int ret, fd;
+	size_t plane, size;
+
+	size = ALIGN(bo->total_size, getpagesize());
+
+	fd = memfd_create("minigbm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		fprintf(stderr, "drv: memfd_create failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		ret = -errno;
+		fprintf(stderr, "drv: ftruncate failed (size=%zu)\n", size);
+		close(fd);
+		return ret;
+	}
+
+	fd = sw_handle_from_fd(sw_export_udmabuf(bo->drv->priv, fd, size));
+	if (fd < 0)
+		return -errno;
+
+	for (plane = 0; plane < bo->num_planes; plane++)
+		bo->handles[plane].u32 = fd;
+
+	return 0;
+}
+
+static int sw_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			uint64_t use_flags)
+{
+	int ret;
+
+	ret = sw_bo_compute_layout(bo, width, height, format, use_flags);
+	if (ret)
+		return ret;
+
+	return sw_bo_create_from_layout(bo);
+}
+
+static int sw_bo_destroy(struct bo *bo)
+{
+	size_t plane, i;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		for (i = 0; i < plane; i++)
+			if (bo->handles[i].u32 == bo->handles[plane].u32)
+				break;
+
+		if (i == plane)
+			close(bo->handles[plane].u32);
+	}
+
+	return 0;
+}
+
+static int sw_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret, fd;
+	size_t plane, i;
+	uint32_t shards;
+
+	for (plane = 0; plane < bo->num_planes; plane++) {
+		for (i = 0; i < plane; i++)
+			if (data->fds[i] == data->fds[plane])
+				break;
+
+		if (i != plane) {
+			bo->handles[plane].u32 = bo->handles[i].u32;
+			continue;
+		}
+
+		fd = fcntl(data->fds[plane], F_DUPFD_CLOEXEC, 1);
+		if (fd < 0) {
+			ret = -errno;
+			fprintf(stderr, "drv: failed to duplicate fd %d\n", data->fds[plane]);
+			bo->num_planes = plane;
+			sw_bo_destroy(bo);
+			return ret;
+		}
+
+		bo->handles[plane].u32 = fd;
+	}
+
+	shards = drv_bo_shards(bo);
+	drv_lock_shards(bo->drv, shards);
+	ret = drv_bo_reference_handles(bo->drv, bo);
+	drv_unlock_shards(bo->drv, shards);
+
+	if (ret) {
+		sw_bo_destroy(bo);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void *sw_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags)
+{
+	size_t i;
+
+	for (i = 0; i < bo->num_planes; i++)
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			data->length = MAX(data->length, bo->offsets[i] + bo->sizes[i]);
+
+	return mmap(0, data->length, drv_get_prot(map_flags), MAP_SHARED, bo->handles[plane].u32,
+		    0);
+}
+
+static int sw_bo_get_plane_fd(struct bo *bo, size_t plane)
+{
+	int fd;
+
+	fd = fcntl(bo->handles[plane].u32, F_DUPFD_CLOEXEC, 0);
+	return (fd < 0) ? -errno : fd;
+}
+
+static uint32_t sw_resolve_format(uint32_t format, uint64_t use_flags)
+{
+	switch (format) {
+	case DRM_FORMAT_FLEX_IMPLEMENTATION_DEFINED:
+		return DRM_FORMAT_XBGR8888;
+	case DRM_FORMAT_FLEX_YCbCr_420_888:
+		return DRM_FORMAT_YVU420;
+	default:
+		return format;
+	}
+}
+
+struct backend backend_sw = {
+	.name = "sw",
+	.init = sw_init,
+	.close = sw_close,
+	.bo_create = sw_bo_create,
+	.bo_compute_layout = sw_bo_compute_layout,
+	.bo_create_from_layout = sw_bo_create_from_layout,
+	.bo_destroy = sw_bo_destroy,
+	.bo_import = sw_bo_import,
+	.bo_map = sw_bo_map,
+	.bo_unmap = drv_bo_munmap,
+	.bo_get_plane_fd = sw_bo_get_plane_fd,
+	.resolve_format = sw_resolve_format,
+};
+
+#endif
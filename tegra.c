@@ -7,12 +7,19 @@
 #ifdef DRV_TEGRA
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <tegra_drm.h>
 #include <xf86drm.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "drv_priv.h"
 #include "helpers.h"
 #include "util.h"
@@ -24,6 +31,8 @@
  */
 #define NV_BLOCKLINEAR_GOB_HEIGHT 8
 #define NV_BLOCKLINEAR_GOB_WIDTH 64
+#define NV_BLOCKLINEAR_GOB_SIZE (NV_BLOCKLINEAR_GOB_WIDTH * NV_BLOCKLINEAR_GOB_HEIGHT)
+#define NV_BLOCKLINEAR_SECTOR_SIZE 16
 #define NV_DEFAULT_BLOCK_HEIGHT_LOG2 4
 #define NV_PREFERRED_PAGE_SIZE (128 * 1024)
 
@@ -44,8 +53,15 @@ enum tegra_map_type {
 struct tegra_private_map_data {
 	void *tiled;
 	void *untiled;
+	/* One bit per GOB written through the untiled copy and not flushed yet. */
+	atomic_uint *dirty;
 };
 
+static size_t tegra_dirty_size(struct bo *bo)
+{
+	return DIV_ROUND_UP(bo->total_size / NV_BLOCKLINEAR_GOB_SIZE, 32) * sizeof(atomic_uint);
+}
+
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ARGB8888, DRM_FORMAT_XRGB8888 };
 
 static int compute_block_height_log2(int height)
@@ -100,83 +116,160 @@ static void compute_layout_linear(int width, int height, int format, uint32_t *s
 	*size = *stride * height;
 }
 
-static void transfer_tile(struct bo *bo, uint8_t *tiled, uint8_t *untiled, enum tegra_map_type type,
-			  uint32_t bytes_per_pixel, uint32_t gob_top, uint32_t gob_left,
-			  uint32_t gob_size_pixels, uint8_t *tiled_last)
+/* Copies one 16-byte sector, the unit in which GOBs swizzle their bytes. */
+static inline void transfer_sector(uint8_t *dst, const uint8_t *src)
 {
-	uint8_t *tmp;
-	uint32_t x, y, k;
-	for (k = 0; k < gob_size_pixels; k++) {
-		/*
-		 * Given the kth pixel starting from the tile specified by
-		 * gob_top and gob_left, unswizzle to get the standard (x, y)
-		 * representation.
-		 */
-		x = gob_left + (((k >> 3) & 8) | ((k >> 1) & 4) | (k & 3));
-		y = gob_top + ((k >> 7 << 3) | ((k >> 3) & 6) | ((k >> 2) & 1));
+#if defined(__SSE2__)
+	_mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+#elif defined(__ARM_NEON)
+	vst1q_u8(dst, vld1q_u8(src));
+#else
+	memcpy(dst, src, NV_BLOCKLINEAR_SECTOR_SIZE);
+#endif
+}
 
-		if (tiled >= tiled_last)
-			return;
+/*
+ * Offset in a GOB of the sector holding bytes x to x + 15 of row y. The 32 sectors are ordered
+ * by bits y0, x4, y1, y2, x5 from least to most significant.
+ */
+static inline uint32_t gob_sector_offset(uint32_t x, uint32_t y)
+{
+	uint32_t sector = (y & 1) | ((x >> 3) & 2) | ((y & 6) << 1) | ((x >> 1) & 16);
+	return sector * NV_BLOCKLINEAR_SECTOR_SIZE;
+}
 
-		if (x >= bo->width || y >= bo->height) {
-			tiled += bytes_per_pixel;
-			continue;
+/* Transfers GOB index, whose top left corner is at byte gob_left of row gob_top. */
+static void transfer_gob(struct bo *bo, struct tegra_private_map_data *priv, uint32_t index,
+			 uint32_t gob_top, uint32_t gob_left, enum tegra_map_type type)
+{
+	uint32_t x, y, rows, row_bytes;
+	uint32_t width_bytes = drv_stride_from_format(bo->format, bo->width, 0);
+	uint8_t *gob = (uint8_t *)priv->tiled + index * NV_BLOCKLINEAR_GOB_SIZE;
+	uint8_t *untiled = (uint8_t *)priv->untiled + gob_top * bo->strides[0] + gob_left;
+
+	/* Sectors past the width are transferred whole, which stays within the stride. */
+	rows = MIN(NV_BLOCKLINEAR_GOB_HEIGHT, bo->height - gob_top);
+	row_bytes = MIN(NV_BLOCKLINEAR_GOB_WIDTH, width_bytes - gob_left);
+	row_bytes = ALIGN(row_bytes, NV_BLOCKLINEAR_SECTOR_SIZE);
+
+	for (y = 0; y < rows; y++, untiled += bo->strides[0]) {
+		for (x = 0; x < row_bytes; x += NV_BLOCKLINEAR_SECTOR_SIZE) {
+			if (type == TEGRA_READ_TILED_BUFFER)
+				transfer_sector(untiled + x, gob + gob_sector_offset(x, y));
+			else
+				transfer_sector(gob + gob_sector_offset(x, y), untiled + x);
 		}
-
-		tmp = untiled + y * bo->strides[0] + x * bytes_per_pixel;
-
-		if (type == TEGRA_READ_TILED_BUFFER)
-			memcpy(tmp, tiled, bytes_per_pixel);
-		else if (type == TEGRA_WRITE_TILED_BUFFER)
-			memcpy(tiled, tmp, bytes_per_pixel);
-
-		/* Move on to next pixel. */
-		tiled += bytes_per_pixel;
 	}
 }
 
-static void transfer_tiled_memory(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
-				  enum tegra_map_type type)
+static uint32_t tegra_gob_height(struct bo *bo)
 {
-	uint32_t gob_width, gob_height, gob_size_bytes, gob_size_pixels, gob_count_x, gob_count_y,
-	    gob_top, gob_left;
-	uint32_t i, j, offset;
-	uint8_t *tmp, *tiled_last;
-	uint32_t bytes_per_pixel = drv_stride_from_format(bo->format, 1, 0);
-
 	/*
 	 * The blocklinear format consists of 8*(2^n) x 64 byte sized tiles,
 	 * where 0 <= n <= 4.
 	 */
-	gob_width = DIV_ROUND_UP(NV_BLOCKLINEAR_GOB_WIDTH, bytes_per_pixel);
-	gob_height = NV_BLOCKLINEAR_GOB_HEIGHT * (1 << NV_DEFAULT_BLOCK_HEIGHT_LOG2);
+	uint32_t gob_height = NV_BLOCKLINEAR_GOB_HEIGHT * (1 << NV_DEFAULT_BLOCK_HEIGHT_LOG2);
 	/* Calculate the height from maximum possible gob height */
 	while (gob_height > NV_BLOCKLINEAR_GOB_HEIGHT && gob_height >= 2 * bo->height)
 		gob_height /= 2;
 
-	gob_size_bytes = gob_height * NV_BLOCKLINEAR_GOB_WIDTH;
-	gob_size_pixels = gob_height * gob_width;
-
-	gob_count_x = DIV_ROUND_UP(bo->strides[0], NV_BLOCKLINEAR_GOB_WIDTH);
-	gob_count_y = DIV_ROUND_UP(bo->height, gob_height);
-
-	tiled_last = tiled + bo->total_size;
-
-	offset = 0;
-	for (j = 0; j < gob_count_y; j++) {
-		gob_top = j * gob_height;
-		for (i = 0; i < gob_count_x; i++) {
-			tmp = tiled + offset;
-			gob_left = i * gob_width;
+	return gob_height;
+}
 
-			transfer_tile(bo, tmp, untiled, type, bytes_per_pixel, gob_top, gob_left,
-				      gob_size_pixels, tiled_last);
+/* Transfer of the GOBs that intersect a rectangle, split across threads by block rows. */
+struct tegra_transfer {
+	struct bo *bo;
+	struct tegra_private_map_data *priv;
+	const struct rectangle *rect;
+	uint32_t map_flags;
+	enum tegra_map_type type;
+	uint32_t gob_height;
+	uint32_t gob_count_x;
+	uint32_t rect_bottom;
+	uint32_t first_i;
+	uint32_t last_i;
+	uint32_t first_j;
+};
 
-			offset += gob_size_bytes;
+/*
+ * Transfers block rows first_j + first up to first_j + last. Reads skip dirty GOBs, whose
+ * untiled copy is newer, and mark the GOBs dirty for write mappings. Writes only transfer dirty
+ * GOBs and mark them clean. Whole GOBs are transferred so that a dirty one never carries stale
+ * untiled bytes.
+ */
+static void transfer_block_rows(void *arg, uint32_t first, uint32_t last)
+{
+	struct tegra_transfer *transfer = arg;
+	struct bo *bo = transfer->bo;
+	struct tegra_private_map_data *priv = transfer->priv;
+	uint32_t gobs_per_block = transfer->gob_height / NV_BLOCKLINEAR_GOB_HEIGHT;
+	uint32_t i, j, k, index, bit, dirty, gob_top, gob_left;
+
+	for (j = transfer->first_j + first; j < transfer->first_j + last; j++) {
+		for (i = transfer->first_i; i < transfer->last_i; i++) {
+			gob_left = i * NV_BLOCKLINEAR_GOB_WIDTH;
+			for (k = 0; k < gobs_per_block; k++) {
+				gob_top = j * transfer->gob_height + k * NV_BLOCKLINEAR_GOB_HEIGHT;
+				if (gob_top + NV_BLOCKLINEAR_GOB_HEIGHT <= transfer->rect->y)
+					continue;
+
+				if (gob_top >= transfer->rect_bottom)
+					break;
+
+				index = (j * transfer->gob_count_x + i) * gobs_per_block + k;
+				if ((index + 1) * NV_BLOCKLINEAR_GOB_SIZE > bo->total_size)
+					return;
+
+				/* Neighbouring block rows may share a bitmap word. */
+				bit = 1u << (index % 32);
+				dirty = atomic_load_explicit(&priv->dirty[index / 32],
+							     memory_order_relaxed) & bit;
+				if ((transfer->type == TEGRA_READ_TILED_BUFFER) ? !dirty : dirty)
+					transfer_gob(bo, priv, index, gob_top, gob_left,
+						     transfer->type);
+
+				if (transfer->type == TEGRA_WRITE_TILED_BUFFER)
+					atomic_fetch_and_explicit(&priv->dirty[index / 32], ~bit,
+								  memory_order_relaxed);
+				else if (transfer->map_flags & BO_MAP_WRITE)
+					atomic_fetch_or_explicit(&priv->dirty[index / 32], bit,
+								 memory_order_relaxed);
+			}
 		}
 	}
 }
 
+/* Transfers the GOBs that intersect rect, see transfer_block_rows(). */
+static void transfer_tiled_memory(struct bo *bo, struct tegra_private_map_data *priv,
+				  const struct rectangle *rect, uint32_t map_flags,
+				  enum tegra_map_type type)
+{
+	uint32_t left, right, last_j;
+	struct tegra_transfer transfer;
+
+	left = drv_stride_from_format(bo->format, rect->x, 0);
+	right = drv_stride_from_format(bo->format, rect->x + rect->width, 0);
+
+	transfer.bo = bo;
+	transfer.priv = priv;
+	transfer.rect = rect;
+	transfer.map_flags = map_flags;
+	transfer.type = type;
+	transfer.gob_height = tegra_gob_height(bo);
+	transfer.gob_count_x = DIV_ROUND_UP(bo->strides[0], NV_BLOCKLINEAR_GOB_WIDTH);
+	transfer.rect_bottom = MIN(rect->y + rect->height, bo->height);
+	transfer.first_i = left / NV_BLOCKLINEAR_GOB_WIDTH;
+	transfer.last_i = MIN(DIV_ROUND_UP(right, NV_BLOCKLINEAR_GOB_WIDTH), transfer.gob_count_x);
+	transfer.first_j = rect->y / transfer.gob_height;
+	last_j = DIV_ROUND_UP(transfer.rect_bottom, transfer.gob_height);
+
+	if (last_j <= transfer.first_j)
+		return;
+
+	drv_copy_run(bo->drv, transfer_block_rows, &transfer, last_j - transfer.first_j,
+		     (size_t)(transfer.rect_bottom - rect->y) * bo->strides[0]);
+}
+
 static int tegra_init(struct driver *drv)
 {
 	int ret;
@@ -212,13 +305,11 @@ static int tegra_init(struct driver *drv)
 	return 0;
 }
 
-static int tegra_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-			   uint64_t use_flags)
+static int tegra_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height,
+				   uint32_t format, uint64_t use_flags)
 {
 	uint32_t size, stride, block_height_log2 = 0;
 	enum nv_mem_kind kind = NV_MEM_KIND_PITCH;
-	struct drm_tegra_gem_create gem_create;
-	int ret;
 
 	if (use_flags &
 	    (BO_USE_CURSOR | BO_USE_LINEAR | BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN))
@@ -227,28 +318,44 @@ static int tegra_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint3
 		compute_layout_blocklinear(width, height, format, &kind, &block_height_log2,
 					   &stride, &size);
 
+	bo->offsets[0] = 0;
+	bo->total_size = bo->sizes[0] = size;
+	bo->strides[0] = stride;
+
+	if (kind != NV_MEM_KIND_PITCH) {
+		/* Encode blocklinear parameters for EGLImage creation. */
+		bo->tiling = (kind & 0xff) | ((block_height_log2 & 0xf) << 8);
+		bo->format_modifiers[0] = fourcc_mod_code(NV, bo->tiling);
+	}
+
+	return 0;
+}
+
+static int tegra_bo_create_from_layout(struct bo *bo)
+{
+	struct drm_tegra_gem_create gem_create;
+	int ret;
+
 	memset(&gem_create, 0, sizeof(gem_create));
-	gem_create.size = size;
+	gem_create.size = bo->total_size;
 	gem_create.flags = 0;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_TEGRA_GEM_CREATE, &gem_create);
 	if (ret) {
-		fprintf(stderr, "drv: DRM_IOCTL_TEGRA_GEM_CREATE failed (size=%zu)\n", size);
+		fprintf(stderr, "drv: DRM_IOCTL_TEGRA_GEM_CREATE failed (size=%zu)\n",
+			bo->total_size);
 		return ret;
 	}
 
 	bo->handles[0].u32 = gem_create.handle;
-	bo->offsets[0] = 0;
-	bo->total_size = bo->sizes[0] = size;
-	bo->strides[0] = stride;
 
-	if (kind != NV_MEM_KIND_PITCH) {
+	if (bo->tiling != NV_MEM_KIND_PITCH) {
 		struct drm_tegra_gem_set_tiling gem_tile;
 
 		memset(&gem_tile, 0, sizeof(gem_tile));
 		gem_tile.handle = bo->handles[0].u32;
 		gem_tile.mode = DRM_TEGRA_GEM_TILING_MODE_BLOCK;
-		gem_tile.value = block_height_log2;
+		gem_tile.value = (bo->tiling >> 8) & 0xf;
 
 		ret = drmCommandWriteRead(bo->drv->fd, DRM_TEGRA_GEM_SET_TILING, &gem_tile,
 					  sizeof(gem_tile));
@@ -256,15 +363,23 @@ static int tegra_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint3
 			drv_gem_bo_destroy(bo);
 			return ret;
 		}
-
-		/* Encode blocklinear parameters for EGLImage creation. */
-		bo->tiling = (kind & 0xff) | ((block_height_log2 & 0xf) << 8);
-		bo->format_modifiers[0] = fourcc_mod_code(NV, bo->tiling);
 	}
 
 	return 0;
 }
 
+static int tegra_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			   uint64_t use_flags)
+{
+	int ret;
+
+	ret = tegra_bo_compute_layout(bo, width, height, format, use_flags);
+	if (ret)
+		return ret;
+
+	return tegra_bo_create_from_layout(bo);
+}
+
 static int tegra_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 {
 	int ret;
@@ -280,7 +395,7 @@ static int tegra_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_TEGRA_GEM_GET_TILING, &gem_get_tiling);
 	if (ret) {
-		drv_gem_bo_destroy(bo);
+		drv_prime_bo_unimport(bo);
 		return ret;
 	}
 
@@ -292,8 +407,9 @@ static int tegra_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 		bo->tiling = NV_MEM_KIND_C32_2CRA;
 	} else {
 		fprintf(stderr, "tegra_bo_import: unknown tile format %d", gem_get_tiling.mode);
-		drv_gem_bo_destroy(bo);
+		drv_prime_bo_unimport(bo);
 		assert(0);
+		return -EINVAL;
 	}
 
 	bo->format_modifiers[0] = fourcc_mod_code(NV, bo->tiling);
@@ -319,23 +435,48 @@ static void *tegra_bo_map(struct bo *bo, struct map_info *data, size_t plane, ui
 			  gem_map.offset);
 	data->length = bo->total_size;
 	if ((bo->tiling & 0xFF) == NV_MEM_KIND_C32_2CRA && addr != MAP_FAILED) {
-		priv = calloc(1, sizeof(*priv));
-		priv->untiled = calloc(1, bo->total_size);
+		/*
+		 * The untiled copy is the handle's shadow, filled in by tegra_bo_invalidate() as
+		 * regions get mapped. The dirty bitmap belongs to this mapping, so one that loses
+		 * a race in drv_bo_map() leaves the winner's alone, and writes an earlier mapping
+		 * never flushed are dropped.
+		 */
+		priv = calloc(1, sizeof(*priv) + tegra_dirty_size(bo));
+		if (priv)
+			priv->untiled = drv_bo_get_shadow(bo, plane, map_flags, bo->total_size);
+
+		if (!priv || !priv->untiled) {
+			free(priv);
+			munmap(addr, bo->total_size);
+			return MAP_FAILED;
+		}
+
 		priv->tiled = addr;
+		priv->dirty = (atomic_uint *)(priv + 1);
 		data->priv = priv;
-		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_READ_TILED_BUFFER);
 		addr = priv->untiled;
 	}
 
+	/* GEM mappings are write-combined, the CPU copy above isn't. */
+	data->write_combined = !data->priv;
 	return addr;
 }
 
+static int tegra_bo_invalidate(struct bo *bo, struct map_info *data, const struct rectangle *rect)
+{
+	struct tegra_private_map_data *priv = data->priv;
+
+	if (priv)
+		transfer_tiled_memory(bo, priv, rect, data->map_flags, TEGRA_READ_TILED_BUFFER);
+
+	return 0;
+}
+
 static int tegra_bo_unmap(struct bo *bo, struct map_info *data)
 {
 	if (data->priv) {
 		struct tegra_private_map_data *priv = data->priv;
 		data->addr = priv->tiled;
-		free(priv->untiled);
 		free(priv);
 		data->priv = NULL;
 	}
@@ -343,12 +484,12 @@ static int tegra_bo_unmap(struct bo *bo, struct map_info *data)
 	return munmap(data->addr, data->length);
 }
 
-static int tegra_bo_flush(struct bo *bo, struct map_info *data)
+static int tegra_bo_flush(struct bo *bo, struct map_info *data, const struct rectangle *rect)
 {
 	struct tegra_private_map_data *priv = data->priv;
 
 	if (priv && (data->map_flags & BO_MAP_WRITE))
-		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_WRITE_TILED_BUFFER);
+		transfer_tiled_memory(bo, priv, rect, data->map_flags, TEGRA_WRITE_TILED_BUFFER);
 
 	return 0;
 }
@@ -357,10 +498,13 @@ struct backend backend_tegra = {
 	.name = "tegra",
 	.init = tegra_init,
 	.bo_create = tegra_bo_create,
+	.bo_compute_layout = tegra_bo_compute_layout,
+	.bo_create_from_layout = tegra_bo_create_from_layout,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = tegra_bo_import,
 	.bo_map = tegra_bo_map,
 	.bo_unmap = tegra_bo_unmap,
+	.bo_invalidate = tegra_bo_invalidate,
 	.bo_flush = tegra_bo_flush,
 };
 
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include "../drv_priv.h"
+#include "../gbm.h"
+#include "../util.h"
+#include "test.h"
+
+static const struct drv_bo_descriptor descriptors[] = {
+	{ 640, 480, DRM_FORMAT_XRGB8888, BO_USE_RENDERING },
+	{ 640, 480, DRM_FORMAT_XRGB8888, BO_USE_RENDERING },
+	{ 333, 77, DRM_FORMAT_NV12, BO_USE_TEXTURE },
+	{ 333, 77, DRM_FORMAT_NV12, BO_USE_TEXTURE },
+	{ 640, 480, DRM_FORMAT_XRGB8888, BO_USE_RENDERING },
+};
+
+#define NUM_DESCRIPTORS ARRAY_SIZE(descriptors)
+
+/* Batched buffers are distinct and laid out exactly like individually created ones. */
+static int test_batch_matches_single(void)
+{
+	size_t i, plane;
+	struct bo *bos[NUM_DESCRIPTORS], *bo;
+	struct driver *drv = drv_create(-1);
+
+	CHECK(drv);
+	CHECK(drv_bo_create_batch(drv, descriptors, NUM_DESCRIPTORS, bos) == 0);
+
+	for (i = 0; i < NUM_DESCRIPTORS; i++) {
+		bo = drv_bo_create(drv, descriptors[i].width, descriptors[i].height,
+				   descriptors[i].format, descriptors[i].use_flags);
+		CHECK(bo);
+		CHECK(bo->num_planes == bos[i]->num_planes);
+		CHECK(bo->total_size == bos[i]->total_size);
+		for (plane = 0; plane < bo->num_planes; plane++) {
+			CHECK(bo->strides[plane] == bos[i]->strides[plane]);
+			CHECK(bo->offsets[plane] == bos[i]->offsets[plane]);
+		}
+
+		CHECK(bos[i]->handles[0].u32 != bos[(i + 1) % NUM_DESCRIPTORS]->handles[0].u32);
+		drv_bo_destroy(bo);
+	}
+
+	for (i = 0; i < NUM_DESCRIPTORS; i++)
+		drv_bo_destroy(bos[i]);
+
+	drv_destroy(drv);
+	return 0;
+}
+
+static int test_batch_empty(void)
+{
+	struct bo *bo = NULL;
+	struct gbm_bo *gbm_bo = NULL;
+	struct driver *drv = drv_create(-1);
+	struct gbm_device *gbm = gbm_create_device(-1);
+
+	CHECK(drv && gbm);
+	CHECK(drv_bo_create_batch(drv, descriptors, 0, &bo) == 0);
+	CHECK(!bo);
+	CHECK(gbm_bo_create_batch(gbm, 64, 64, GBM_FORMAT_XRGB8888, GBM_BO_USE_RENDERING, 0,
+				  &gbm_bo) == 0);
+	CHECK(!gbm_bo);
+
+	gbm_device_destroy(gbm);
+	drv_destroy(drv);
+	return 0;
+}
+
+static int test_batch_invalid_format(void)
+{
+	struct bo *bos[2] = { NULL, NULL };
+	struct drv_bo_descriptor invalid[2] = { descriptors[0], descriptors[0] };
+	struct driver *drv = drv_create(-1);
+	int fds;
+
+	CHECK(drv);
+	invalid[1].format = 0;
+
+	fds = test_count_fds();
+	CHECK(drv_bo_create_batch(drv, invalid, 2, bos) == -EINVAL);
+	CHECK(!bos[0] && !bos[1]);
+	CHECK(test_count_fds() == fds);
+
+	drv_destroy(drv);
+	return 0;
+}
+
+/* When a later allocation fails, the buffers created before it are released. */
+static int test_batch_rollback(void)
+{
+	size_t i;
+	int ret, fds;
+	struct rlimit old, limit;
+	struct bo *bos[NUM_DESCRIPTORS + 1];
+	struct drv_bo_descriptor batch[NUM_DESCRIPTORS + 1];
+	struct driver *drv = drv_create(-1);
+
+	CHECK(drv);
+
+	for (i = 0; i < NUM_DESCRIPTORS; i++)
+		batch[i] = descriptors[i];
+
+	/* The sw backend sizes its memfds with ftruncate(), which fails past RLIMIT_FSIZE. */
+	batch[NUM_DESCRIPTORS] = descriptors[0];
+	batch[NUM_DESCRIPTORS].width = 8192;
+	batch[NUM_DESCRIPTORS].height = 8192;
+
+	CHECK(getrlimit(RLIMIT_FSIZE, &old) == 0);
+	limit = old;
+	limit.rlim_cur = 16 * 1024 * 1024;
+	signal(SIGXFSZ, SIG_IGN);
+
+	fds = test_count_fds();
+	CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+	ret = drv_bo_create_batch(drv, batch, NUM_DESCRIPTORS + 1, bos);
+	CHECK(setrlimit(RLIMIT_FSIZE, &old) == 0);
+
+	CHECK(ret < 0);
+	for (i = 0; i < NUM_DESCRIPTORS + 1; i++)
+		CHECK(!bos[i]);
+	CHECK(test_count_fds() == fds);
+
+	/* Nothing of the failed batch stays behind in the handle table. */
+	CHECK(drv_bo_create_batch(drv, batch, NUM_DESCRIPTORS + 1, bos) == 0);
+	for (i = 0; i < NUM_DESCRIPTORS + 1; i++)
+		drv_bo_destroy(bos[i]);
+	CHECK(test_count_fds() == fds);
+
+	drv_destroy(drv);
+	return 0;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	RUN_TEST(test_batch_matches_single, failures);
+	RUN_TEST(test_batch_empty, failures);
+	RUN_TEST(test_batch_invalid_format, failures);
+	RUN_TEST(test_batch_rollback, failures);
+
+	return failures ? 1 : 0;
+}
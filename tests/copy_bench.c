@@ -0,0 +1,80 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times whole-buffer region copies between two CPU copies of sw buffers across buffer sizes, on
+ * the calling thread and split across the copy engine, to place the default copy threshold.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../drv_priv.h"
+#include "../helpers.h"
+#include "../util.h"
+#include "test.h"
+
+#define ROUNDS 50
+
+static double bench(struct bo *bo, uint8_t *dst, const uint8_t *src, size_t min_size)
+{
+	uint32_t r;
+	double start;
+	struct rectangle rect = { 0, 0, bo->width, bo->height };
+
+	drv_set_copy_threshold(bo->drv, min_size);
+
+	/* Warms up the caches, and the workers on the first parallel copy. */
+	drv_bo_copy_region(bo, dst, src, &rect);
+
+	start = test_now_ns();
+	for (r = 0; r < ROUNDS; r++)
+		drv_bo_copy_region(bo, dst, src, &rect);
+
+	return (test_now_ns() - start) / 1e6 / ROUNDS;
+}
+
+int main(void)
+{
+	size_t i;
+	uint8_t *src, *dst;
+	struct bo *bo;
+	struct driver *drv = drv_create(-1);
+	/* Rows of 4 KiB, for buffers of 256 KiB to 64 MiB. */
+	static const uint32_t heights[] = { 64, 256, 512, 1024, 2048, 4096, 16384 };
+
+	if (!drv)
+		return 1;
+
+	for (i = 0; i < ARRAY_SIZE(heights); i++) {
+		bo = drv_bo_create(drv, 1024, heights[i], DRM_FORMAT_ARGB8888,
+				   BO_USE_SW_READ_OFTEN);
+		if (!bo)
+			return 1;
+
+		src = malloc(bo->total_size);
+		dst = malloc(bo->total_size);
+		if (!src || !dst)
+			return 1;
+
+		memset(src, 0x5a, bo->total_size);
+		memset(dst, 0, bo->total_size);
+
+		printf("%6zu KiB: serial %8.3f ms, parallel %8.3f ms\n", bo->total_size >> 10,
+		       bench(bo, dst, src, SIZE_MAX), bench(bo, dst, src, 0));
+
+		free(src);
+		free(dst);
+		drv_bo_destroy(bo);
+	}
+
+	/* Without workers both columns time the same copy. */
+	printf("copy engine workers: %u\n", drv->copy_engine.num_workers);
+	drv_destroy(drv);
+	return 0;
+}
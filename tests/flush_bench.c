@@ -0,0 +1,69 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times the cache writeback loops i915_bo_flush() picks between on non-LLC parts, with the fences
+ * it issues around them. The backend is compiled into this file so the static loops can be called.
+ */
+
+#include "../i915.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+
+#define ROUNDS 20
+
+static const char *method_names[] = { "clflush", "clflushopt", "clwb" };
+
+/* Returns the time to write back size dirty bytes, in microseconds per MiB. */
+static double bench_flush(enum i915_flush_method method, uint8_t *buf, size_t size)
+{
+	uint32_t r;
+	double start, total = 0;
+	struct i915_device i915 = { .flush_method = method };
+
+	for (r = 0; r < ROUNDS; r++) {
+		memset(buf, r, size);
+
+		start = test_now_ns();
+		if (method == I915_FLUSH_CLFLUSH)
+			__builtin_ia32_mfence();
+		i915_flush_range(&i915, buf, size);
+		if (method != I915_FLUSH_CLFLUSH)
+			__builtin_ia32_sfence();
+		total += test_now_ns() - start;
+	}
+
+	return total / 1e3 / ROUNDS / ((double)size / (1 << 20));
+}
+
+int main(void)
+{
+	size_t i;
+	uint8_t *buf;
+	enum i915_flush_method method;
+	static const size_t sizes[] = { 64 << 10, 1 << 20, 8 << 20, 64 << 20 };
+
+	buf = aligned_alloc(I915_CACHELINE_SIZE, sizes[ARRAY_SIZE(sizes) - 1]);
+	if (!buf)
+		return 1;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (method = I915_FLUSH_CLFLUSH; method <= I915_FLUSH_CLWB; method++) {
+			if (!i915_flush_method_supported(method))
+				continue;
+
+			printf("%-10s %6zu KiB: %8.1f us/MiB\n", method_names[method],
+			       sizes[i] >> 10, bench_flush(method, buf, sizes[i]));
+		}
+	}
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "../helpers.h"
+#include "test.h"
+
+/*
+ * Compares the handle map with the drmHash table it replaced. Each round inserts n handles,
+ * looks every handle up once and removes them again; times are per operation.
+ */
+
+#define OPS_PER_SIZE 4000000
+#define VALUE(key) ((void *)((uintptr_t)(key)*16))
+
+struct result {
+	double insert;
+	double lookup;
+	double remove;
+};
+
+static void bench_handle_map(uint32_t n, uint32_t rounds, struct result *result)
+{
+	uint32_t i, r;
+	double t0, t1, t2, t3;
+	uintptr_t sum = 0;
+	struct handle_map map = { 0 };
+
+	*result = (struct result){ 0 };
+	for (r = 0; r < rounds; r++) {
+		t0 = test_now_ns();
+		for (i = 1; i <= n; i++)
+			drv_handle_map_insert(&map, i, VALUE(i));
+		t1 = test_now_ns();
+		for (i = 1; i <= n; i++)
+			sum += (uintptr_t)drv_handle_map_lookup(&map, i);
+		t2 = test_now_ns();
+		for (i = 1; i <= n; i++)
+			drv_handle_map_remove(&map, i);
+		t3 = test_now_ns();
+
+		result->insert += t1 - t0;
+		result->lookup += t2 - t1;
+		result->remove += t3 - t2;
+	}
+
+	drv_handle_map_fini(&map);
+	if (!sum)
+		abort();
+}
+
+static void bench_drm_hash(uint32_t n, uint32_t rounds, struct result *result)
+{
+	uint32_t i, r;
+	double t0, t1, t2, t3;
+	uintptr_t sum = 0;
+	void *value, *table = drmHashCreate();
+
+	*result = (struct result){ 0 };
+	for (r = 0; r < rounds; r++) {
+		t0 = test_now_ns();
+		for (i = 1; i <= n; i++)
+			drmHashInsert(table, i, VALUE(i));
+		t1 = test_now_ns();
+		for (i = 1; i <= n; i++)
+			if (!drmHashLookup(table, i, &value))
+				sum += (uintptr_t)value;
+		t2 = test_now_ns();
+		for (i = 1; i <= n; i++)
+			drmHashDelete(table, i);
+		t3 = test_now_ns();
+
+		result->insert += t1 - t0;
+		result->lookup += t2 - t1;
+		result->remove += t3 - t2;
+	}
+
+	drmHashDestroy(table);
+	if (!sum)
+		abort();
+}
+
+static void print_result(const char *name, uint32_t n, uint32_t rounds, const struct result *r)
+{
+	double ops = (double)n * rounds;
+
+	printf("%-10s %7u handles: insert %6.1f ns, lookup %6.1f ns, remove %6.1f ns\n", name, n,
+	       r->insert / ops, r->lookup / ops, r->remove / ops);
+}
+
+int main(void)
+{
+	size_t i;
+	uint32_t rounds;
+	struct result result;
+	static const uint32_t sizes[] = { 10, 1000, 100000 };
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		rounds = OPS_PER_SIZE / sizes[i];
+
+		bench_handle_map(sizes[i], rounds, &result);
+		print_result("handle_map", sizes[i], rounds, &result);
+		bench_drm_hash(sizes[i], rounds, &result);
+		print_result("drmHash", sizes[i], rounds, &result);
+	}
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../drv_priv.h"
+#include "../helpers.h"
+#include "../util.h"
+#include "test.h"
+
+#define VALUE(key) ((void *)((uintptr_t)(key)*16))
+
+/* Capacity of a map after its first insert. */
+static uint32_t min_capacity;
+
+/* Returns the slot key lands in when it is alone in a map of the given capacity. */
+static uint32_t home_slot(uint32_t key, uint32_t capacity)
+{
+	uint32_t i;
+	struct handle_map map = { 0 };
+
+	map.entries = calloc(capacity, sizeof(*map.entries));
+	map.capacity = capacity;
+	drv_handle_map_insert(&map, key, VALUE(key));
+	for (i = 0; map.entries[i].key != key; i++)
+		;
+
+	drv_handle_map_fini(&map);
+	return i;
+}
+
+static void init_min_capacity(void)
+{
+	struct handle_map map = { 0 };
+
+	drv_handle_map_insert(&map, 1, VALUE(1));
+	min_capacity = map.capacity;
+	drv_handle_map_fini(&map);
+}
+
+/* Collects count keys, starting at *next, whose home slot is home. */
+static void keys_for_slot(uint32_t home, uint32_t *next, uint32_t *keys, uint32_t count)
+{
+	while (count) {
+		if (home_slot(*next, min_capacity) == home) {
+			*keys++ = *next;
+			count--;
+		}
+		(*next)++;
+	}
+}
+
+/* Every entry must be reachable by probing from its home slot without crossing an empty one. */
+static int check_map(const struct handle_map *map, const uint32_t *keys, uint32_t count)
+{
+	uint32_t i, j, found = 0;
+	uint32_t mask = map->capacity - 1;
+
+	for (i = 0; i < map->capacity; i++) {
+		if (!map->entries[i].key)
+			continue;
+
+		found++;
+		CHECK(map->entries[i].value == VALUE(map->entries[i].key));
+		for (j = home_slot(map->entries[i].key, map->capacity); j != i; j = (j + 1) & mask)
+			CHECK(map->entries[j].key);
+	}
+
+	CHECK(found == count && map->count == count);
+	for (i = 0; i < count; i++)
+		CHECK(drv_handle_map_lookup(map, keys[i]) == VALUE(keys[i]));
+
+	return 0;
+}
+
+/* Removes keys[index], keeping keys[0..count - 1] as the live set. */
+static int remove_key(struct handle_map *map, uint32_t *keys, uint32_t count, uint32_t index)
+{
+	uint32_t key = keys[index];
+
+	drv_handle_map_remove(map, key);
+	keys[index] = keys[count - 1];
+	CHECK(!drv_handle_map_lookup(map, key));
+	return check_map(map, keys, count - 1);
+}
+
+/* A cluster starting in the last slot wraps around to the front of the table. */
+static int test_remove_wraparound(void)
+{
+	uint32_t i, n, next = 1, keys[8];
+	uint32_t order[8];
+	struct handle_map map = { 0 };
+
+	/* Four keys homed in the last slot, then two homed in slot 0 and one in slot 1. */
+	keys_for_slot(min_capacity - 1, &next, keys, 4);
+	keys_for_slot(0, &next, keys + 4, 2);
+	keys_for_slot(1, &next, keys + 6, 1);
+
+	/* Remove from the start, the middle and the wrapped part of the cluster. */
+	for (n = 0; n < 7; n++) {
+		for (i = 0; i < 7; i++) {
+			order[i] = keys[i];
+			CHECK(drv_handle_map_insert(&map, order[i], VALUE(order[i])) == 0);
+		}
+
+		CHECK(map.capacity == min_capacity);
+		CHECK(check_map(&map, order, 7) == 0);
+		CHECK(map.entries[0].key && map.entries[min_capacity - 1].key);
+
+		for (i = 7; i > 0; i--)
+			CHECK(remove_key(&map, order, i, (n + i) % i) == 0);
+
+		drv_handle_map_fini(&map);
+	}
+
+	return 0;
+}
+
+/* Removing from a table filled to its load limit, where clusters are long and merge. */
+static int test_remove_full_cluster(void)
+{
+	uint32_t i, count, key, keys[64];
+	struct handle_map map = { 0 };
+
+	CHECK(min_capacity <= ARRAY_SIZE(keys));
+	for (key = 1, count = 0;; key++) {
+		CHECK(drv_handle_map_insert(&map, key, VALUE(key)) == 0);
+		if (map.capacity != min_capacity)
+			break;
+		keys[count++] = key;
+	}
+
+	/* The last insert grew the map, so rebuild it with the keys that fit. */
+	drv_handle_map_fini(&map);
+	for (i = 0; i < count; i++)
+		CHECK(drv_handle_map_insert(&map, keys[i], VALUE(keys[i])) == 0);
+	CHECK(map.capacity == min_capacity);
+
+	CHECK(check_map(&map, keys, count) == 0);
+
+	/* Missing keys leave the map untouched. */
+	drv_handle_map_remove(&map, key + 1);
+	CHECK(check_map(&map, keys, count) == 0);
+
+	srand(1);
+	for (i = count; i > 0; i--)
+		CHECK(remove_key(&map, keys, i, rand() % i) == 0);
+
+	drv_handle_map_fini(&map);
+	return 0;
+}
+
+/* Random inserts and removals against a plain array, across several resizes. */
+static int test_random_operations(void)
+{
+	uint32_t i, j, count = 0, keys[4096];
+	struct handle_map map = { 0 };
+
+	srand(2);
+	for (i = 0; i < 100000; i++) {
+		uint32_t key = 1 + rand() % 8192;
+
+		for (j = 0; j < count && keys[j] != key; j++)
+			;
+
+		if (j < count) {
+			drv_handle_map_remove(&map, key);
+			keys[j] = keys[--count];
+			CHECK(!drv_handle_map_lookup(&map, key));
+		} else if (count < ARRAY_SIZE(keys)) {
+			CHECK(!drv_handle_map_lookup(&map, key));
+			CHECK(drv_handle_map_insert(&map, key, VALUE(key)) == 0);
+			keys[count++] = key;
+		}
+
+		if (!(i % 1000))
+			CHECK(check_map(&map, keys, count) == 0);
+	}
+
+	CHECK(check_map(&map, keys, count) == 0);
+	drv_handle_map_fini(&map);
+	return 0;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	init_min_capacity();
+	RUN_TEST(test_remove_wraparound, failures);
+	RUN_TEST(test_remove_full_cluster, failures);
+	RUN_TEST(test_random_operations, failures);
+
+	return failures ? 1 : 0;
+}
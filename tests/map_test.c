@@ -0,0 +1,731 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "../helpers.h"
+#include "../util.h"
+#include "test.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+#define NUM_BOS (DRV_LOCK_SHARDS + 1)
+
+static uint64_t sync_flags[4];
+static uint32_t sync_count;
+static uint32_t closed_handles[4];
+static uint32_t close_count;
+
+/*
+ * Records DMA_BUF_IOCTL_SYNC, which sw buffers don't all support, and DRM_IOCTL_GEM_CLOSE, which
+ * they don't have, instead of issuing them.
+ */
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	if (request == DMA_BUF_IOCTL_SYNC) {
+		if (sync_count < ARRAY_SIZE(sync_flags))
+			sync_flags[sync_count] = ((struct dma_buf_sync *)arg)->flags;
+
+		sync_count++;
+		return 0;
+	}
+
+	if (request == DRM_IOCTL_GEM_CLOSE) {
+		if (close_count < ARRAY_SIZE(closed_handles))
+			closed_handles[close_count] = ((struct drm_gem_close *)arg)->handle;
+
+		close_count++;
+		return 0;
+	}
+
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+
+	return ret;
+}
+
+static struct bo *create_bo(struct driver *drv)
+{
+	return drv_bo_create(drv, WIDTH, HEIGHT, DRM_FORMAT_XRGB8888, BO_USE_SW_READ_OFTEN);
+}
+
+static void *map_bo(struct bo *bo, uint32_t map_flags, struct map_info **map)
+{
+	return drv_bo_map(bo, 0, 0, WIDTH, HEIGHT, map_flags, map, 0);
+}
+
+static int map_unmap(struct bo *bo, uint32_t map_flags)
+{
+	struct map_info *map;
+
+	CHECK(map_bo(bo, map_flags, &map) != MAP_FAILED);
+	CHECK(drv_bo_unmap(bo, map) == 0);
+	return 0;
+}
+
+/* Finds two buffers whose handles fall into the same shard. */
+static int same_shard(struct bo **bos, struct bo **a, struct bo **b)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < NUM_BOS; i++) {
+		for (j = i + 1; j < NUM_BOS; j++) {
+			if (DRV_SHARD(drv_bo_get_plane_handle(bos[i], 0).u32) ==
+			    DRV_SHARD(drv_bo_get_plane_handle(bos[j], 0).u32)) {
+				*a = bos[i];
+				*b = bos[j];
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Makes bo shared, with a pipe standing in for its dma-buf. Reads wait on it until a byte is
+ * written to *busy_fd, as they would on a pending GPU write.
+ */
+static int make_busy(struct bo *bo, int *busy_fd)
+{
+	int fds[2];
+	struct handle_record *record = bo->records[0];
+
+	CHECK(atomic_load(&record->dma_buf_fd) < 0);
+	CHECK(pipe2(fds, O_CLOEXEC) == 0);
+
+	/* The record closes the read end when the handle is released. */
+	atomic_store(&record->dma_buf_fd, fds[0]);
+	bo->shared = true;
+	*busy_fd = fds[1];
+	return 0;
+}
+
+/* Thread that lets the GPU work of make_busy() finish a little later. */
+static void *finish_later(void *arg)
+{
+	int *busy_fd = arg;
+
+	usleep(20000);
+	if (write(*busy_fd, "", 1) != 1)
+		perror("write");
+
+	return NULL;
+}
+
+/* Returns whether the kernel was told that addr is read sequentially, or -1 if it isn't mapped. */
+static int read_sequentially(const void *addr)
+{
+	int ret = -1;
+	char line[256];
+	unsigned long start, end;
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+
+	if (!smaps)
+		return -1;
+
+	while (fgets(line, sizeof(line), smaps)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			if (ret >= 0)
+				break;
+
+			if ((unsigned long)addr >= start && (unsigned long)addr < end)
+				ret = 0;
+		} else if (ret >= 0 && !strncmp(line, "VmFlags:", 8)) {
+			ret = strstr(line, " sr") != NULL;
+		}
+	}
+
+	fclose(smaps);
+	return ret;
+}
+
+/* Mapping a buffer again after unmapping it reuses the cached mapping. */
+static int test_cache_hit(void)
+{
+	void *first, *second;
+	struct map_info *map;
+	struct drv_map_cache_stats stats;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	drv_set_map_cache_limits(drv, 64 << 20, 0);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	first = map_bo(bo, BO_MAP_READ, &map);
+	CHECK(first != MAP_FAILED);
+	CHECK(drv_bo_unmap(bo, map) == 0);
+
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.misses == 1 && stats.hits == 0);
+	CHECK(stats.count == 1 && stats.size >= WIDTH * HEIGHT * 4);
+
+	second = map_bo(bo, BO_MAP_READ, &map);
+	CHECK(second == first);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.misses == 1 && stats.hits == 1);
+
+	/* A mapping in use is not in the cache. */
+	CHECK(stats.count == 0 && stats.size == 0);
+	CHECK(drv_bo_unmap(bo, map) == 0);
+
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+/* Each shard keeps its share of the budget, evicting its least recently unmapped buffers. */
+static int test_cache_evict(void)
+{
+	uint32_t i;
+	size_t size;
+	struct drv_map_cache_stats stats;
+	struct driver *drv = drv_create(-1);
+	struct bo *bos[NUM_BOS], *a, *b;
+
+	CHECK(drv);
+	for (i = 0; i < NUM_BOS; i++) {
+		bos[i] = create_bo(drv);
+		CHECK(bos[i]);
+	}
+	CHECK(same_shard(bos, &a, &b) == 0);
+
+	/* Learn the mapping size, then leave room for one mapping per shard. */
+	drv_set_map_cache_limits(drv, 64 << 20, 0);
+	CHECK(map_unmap(a, BO_MAP_READ) == 0);
+	drv_get_map_cache_stats(drv, &stats);
+	size = stats.size;
+	drv_set_map_cache_limits(drv, size * DRV_LOCK_SHARDS, 0);
+
+	CHECK(map_unmap(b, BO_MAP_READ) == 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 1 && stats.size == size);
+	CHECK(stats.misses == 2);
+
+	CHECK(map_unmap(b, BO_MAP_READ) == 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.hits == 1);
+
+	CHECK(map_unmap(a, BO_MAP_READ) == 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.misses == 3 && stats.count == 1);
+
+	/* The count limit applies on its own too. */
+	drv_set_map_cache_limits(drv, 64 << 20, DRV_LOCK_SHARDS);
+	for (i = 0; i < NUM_BOS; i++)
+		CHECK(map_unmap(bos[i], BO_MAP_READ) == 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count < NUM_BOS && stats.count <= DRV_LOCK_SHARDS);
+
+	for (i = 0; i < NUM_BOS; i++)
+		drv_bo_destroy(bos[i]);
+	drv_destroy(drv);
+	return 0;
+}
+
+/* Cached mappings go away with their buffer, and all of them when the cache is disabled. */
+static int test_cache_invalidate(void)
+{
+	uint32_t i;
+	uint64_t misses;
+	struct drv_map_cache_stats stats;
+	struct driver *drv = drv_create(-1);
+	struct bo *bos[4];
+
+	CHECK(drv);
+	drv_set_map_cache_limits(drv, 64 << 20, 0);
+	for (i = 0; i < 4; i++) {
+		bos[i] = create_bo(drv);
+		CHECK(bos[i]);
+		CHECK(map_unmap(bos[i], BO_MAP_READ) == 0);
+		CHECK(map_unmap(bos[i], BO_MAP_WRITE) == 0);
+	}
+
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 8);
+
+	drv_bo_destroy(bos[0]);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 6);
+
+	drv_set_map_cache_limits(drv, 0, 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 0 && stats.size == 0);
+
+	/* With the cache disabled, every map is a miss. */
+	misses = stats.misses;
+	CHECK(map_unmap(bos[1], BO_MAP_READ) == 0);
+	CHECK(map_unmap(bos[1], BO_MAP_READ) == 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 0 && stats.misses == misses + 2);
+
+	for (i = 1; i < 4; i++)
+		drv_bo_destroy(bos[i]);
+	drv_destroy(drv);
+	return 0;
+}
+
+/* Returns whether addr lies in a mapping that can be written to. */
+static bool is_writable(const void *addr)
+{
+	char line[256], perms[8];
+	unsigned long start, end;
+	bool writable = false;
+	FILE *maps = fopen("/proc/self/maps", "r");
+
+	while (maps && fgets(line, sizeof(line), maps)) {
+		if (sscanf(line, "%lx-%lx %7s", &start, &end, perms) != 3)
+			continue;
+		if ((uintptr_t)addr >= start && (uintptr_t)addr < end)
+			writable = perms[1] == 'w';
+	}
+
+	if (maps)
+		fclose(maps);
+	return writable;
+}
+
+/* A reader and a writer of one buffer get their own mappings, each shared by its kind of user. */
+static int test_read_and_write_slots(void)
+{
+	uint8_t *reader, *writer, *other;
+	struct map_info *read_map, *write_map, *other_map;
+	struct drv_map_cache_stats stats;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	drv_set_map_cache_limits(drv, 64 << 20, 0);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	reader = map_bo(bo, BO_MAP_READ, &read_map);
+	writer = map_bo(bo, BO_MAP_READ_WRITE, &write_map);
+	CHECK(reader != MAP_FAILED && writer != MAP_FAILED);
+	CHECK(read_map != write_map && reader != writer);
+	CHECK(!is_writable(reader) && is_writable(writer));
+
+	writer[5] = 0x5a;
+	CHECK(reader[5] == 0x5a);
+
+	/* Read-only users share the read mapping. */
+	other = map_bo(bo, BO_MAP_READ, &other_map);
+	CHECK(other == reader && other_map == read_map && read_map->refcount == 2);
+	CHECK(drv_bo_unmap(bo, other_map) == 0);
+
+	/* Write-only users share the writable mapping, which accumulates their flags. */
+	other = map_bo(bo, BO_MAP_WRITE, &other_map);
+	CHECK(other == writer && other_map == write_map && write_map->refcount == 2);
+	CHECK(write_map->map_flags == BO_MAP_READ_WRITE);
+	CHECK(drv_bo_unmap(bo, other_map) == 0);
+
+	/* The record is cached once either mapping is idle, and counts each idle mapping. */
+	CHECK(drv_bo_unmap(bo, write_map) == 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 1);
+	CHECK(drv_bo_unmap(bo, read_map) == 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 2);
+
+	/* Evicting the record releases both. */
+	drv_set_map_cache_limits(drv, 0, 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 0 && stats.size == 0);
+
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+/*
+ * Destroying a mapped buffer leaves its mapping alone and the idle mappings of other records in
+ * the shard cached.
+ */
+static int test_destroy_mapped(void)
+{
+	uint32_t i;
+	uint8_t *addr;
+	struct map_info *map;
+	struct drv_map_cache_stats stats;
+	struct driver *drv = drv_create(-1);
+	struct bo *bos[NUM_BOS], *mapped, *cached;
+
+	CHECK(drv);
+	drv_set_map_cache_limits(drv, 64 << 20, 0);
+	for (i = 0; i < NUM_BOS; i++) {
+		bos[i] = create_bo(drv);
+		CHECK(bos[i]);
+	}
+
+	CHECK(same_shard(bos, &mapped, &cached) == 0);
+	CHECK(map_unmap(cached, BO_MAP_READ) == 0);
+	addr = map_bo(mapped, BO_MAP_READ_WRITE, &map);
+	CHECK(addr != MAP_FAILED);
+
+	drv_bo_destroy(mapped);
+	addr[0] = 0x5a;
+	CHECK(addr[0] == 0x5a);
+
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 1);
+
+	/* The cached record is still on the shard's list, so it can be evicted. */
+	drv_set_map_cache_limits(drv, 0, 0);
+	drv_get_map_cache_stats(drv, &stats);
+	CHECK(stats.count == 0 && stats.size == 0);
+
+	for (i = 0; i < NUM_BOS; i++)
+		if (bos[i] != mapped)
+			drv_bo_destroy(bos[i]);
+
+	drv_destroy(drv);
+	return 0;
+}
+
+/* Shadows start out zeroed rather than as a copy of the buffer, then keep their contents. */
+static int test_shadow_reuse(void)
+{
+	uint8_t *addr, *shadow;
+	struct map_info *map;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+	size_t i;
+
+	CHECK(drv);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	addr = map_bo(bo, BO_MAP_WRITE, &map);
+	CHECK(addr != MAP_FAILED && map->length >= bo->total_size);
+	for (i = 0; i < bo->total_size; i++)
+		addr[i] = i;
+
+	shadow = drv_bo_get_shadow(bo, 0, BO_MAP_WRITE, bo->total_size);
+	CHECK(shadow && shadow != addr);
+	for (i = 0; i < bo->total_size; i++)
+		CHECK(!shadow[i]);
+
+	/* Later users get the same shadow, as they left it. */
+	shadow[0] = 0xa5;
+	CHECK(drv_bo_get_shadow(bo, 0, BO_MAP_WRITE, bo->total_size) == shadow);
+	CHECK(shadow[0] == 0xa5);
+
+	/* The read slot has its own shadow. */
+	CHECK(drv_bo_get_shadow(bo, 0, BO_MAP_READ, bo->total_size) != shadow);
+
+	CHECK(drv_bo_unmap(bo, map) == 0);
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+/* Private and idle buffers are reported idle at once; busy ones wait or time out. */
+static int test_wait_idle(void)
+{
+	int busy_fd;
+	double start;
+	pthread_t thread;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	CHECK(drv_bo_wait_idle(bo, BO_MAP_READ_WRITE, 0) == 1);
+	bo->shared = true;
+	CHECK(drv_bo_wait_idle(bo, BO_MAP_READ, 0) == 1);
+	CHECK(drv_bo_wait_idle(bo, BO_MAP_READ_WRITE, 0) == 1);
+	drv_bo_destroy(bo);
+
+	bo = create_bo(drv);
+	CHECK(bo);
+	CHECK(make_busy(bo, &busy_fd) == 0);
+
+	CHECK(drv_bo_wait_idle(bo, BO_MAP_READ, 0) == -ETIME);
+	start = test_now_ns();
+	CHECK(drv_bo_wait_idle(bo, BO_MAP_READ, 20) == -ETIME);
+	/* The deadline is kept in whole milliseconds. */
+	CHECK(test_now_ns() - start >= 19e6);
+
+	CHECK(pthread_create(&thread, NULL, finish_later, &busy_fd) == 0);
+	CHECK(drv_bo_wait_idle(bo, BO_MAP_READ, -1) == 0);
+	pthread_join(thread, NULL);
+	CHECK(drv_bo_wait_idle(bo, BO_MAP_READ, 0) == 1);
+
+	close(busy_fd);
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+/* drv_bo_map_try() maps idle buffers and fails on busy ones once the timeout runs out. */
+static int test_map_try(void)
+{
+	int busy_fd;
+	struct map_info *map;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	CHECK(drv_bo_map_try(bo, 0, 0, WIDTH, HEIGHT, BO_MAP_READ, &map, 0, 0) != MAP_FAILED);
+	CHECK(drv_bo_unmap(bo, map) == 0);
+
+	CHECK(make_busy(bo, &busy_fd) == 0);
+
+	/* A zero timeout only polls, and reports a busy buffer as such. */
+	errno = 0;
+	CHECK(drv_bo_map_try(bo, 0, 0, WIDTH, HEIGHT, BO_MAP_READ, &map, 0, 0) == MAP_FAILED);
+	CHECK(errno == EBUSY);
+
+	errno = 0;
+	CHECK(drv_bo_map_try(bo, 0, 0, WIDTH, HEIGHT, BO_MAP_READ, &map, 0, 10) == MAP_FAILED);
+	CHECK(errno == ETIME);
+
+	CHECK(write(busy_fd, "", 1) == 1);
+	CHECK(drv_bo_map_try(bo, 0, 0, WIDTH, HEIGHT, BO_MAP_READ, &map, 0, 0) != MAP_FAILED);
+	CHECK(drv_bo_unmap(bo, map) == 0);
+
+	close(busy_fd);
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+static int invalidate_calls;
+
+static int count_invalidate(struct bo *bo, struct map_info *data, const struct rectangle *rect)
+{
+	invalidate_calls++;
+	return 0;
+}
+
+/* Backends that opt in skip invalidating shared buffers that had no GPU work pending. */
+static int test_invalidate_skips_idle(void)
+{
+	int busy_fd;
+	pthread_t thread;
+	struct backend backend;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	backend = *drv->backend;
+	backend.flags |= BACKEND_INVALIDATE_SKIP_IDLE;
+	backend.bo_invalidate = count_invalidate;
+	drv->backend = &backend;
+	invalidate_calls = 0;
+
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	/* Private buffers aren't waited for, so they are always invalidated. */
+	CHECK(map_unmap(bo, BO_MAP_READ) == 0);
+	CHECK(invalidate_calls == 1);
+
+	CHECK(make_busy(bo, &busy_fd) == 0);
+	CHECK(pthread_create(&thread, NULL, finish_later, &busy_fd) == 0);
+	CHECK(map_unmap(bo, BO_MAP_READ) == 0);
+	pthread_join(thread, NULL);
+	CHECK(invalidate_calls == 2);
+
+	CHECK(map_unmap(bo, BO_MAP_READ) == 0);
+	CHECK(invalidate_calls == 2);
+
+	close(busy_fd);
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+static int bo_map_calls;
+static void *(*sw_bo_map)(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags);
+
+static void *count_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags)
+{
+	bo_map_calls++;
+	return sw_bo_map(bo, data, plane, map_flags);
+}
+
+/* Sets drv up like a backend that maps and syncs through the dma-bufs of its buffers. */
+static void use_dma_buf_backend(struct driver *drv, struct backend *backend)
+{
+	*backend = *drv->backend;
+	backend->flags |= BACKEND_MAP_DMA_BUF;
+	backend->bo_invalidate = drv_dma_buf_invalidate;
+	backend->bo_flush = drv_dma_buf_flush;
+	sw_bo_map = backend->bo_map;
+	backend->bo_map = count_bo_map;
+	drv->backend = backend;
+
+	bo_map_calls = 0;
+	sync_count = 0;
+}
+
+/* Mappings come from the dma-buf, bracketed by DMA_BUF_IOCTL_SYNC for the mapped access. */
+static int test_dma_buf_map(void)
+{
+	uint8_t *addr;
+	struct map_info *map;
+	struct backend backend;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	use_dma_buf_backend(drv, &backend);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	addr = map_bo(bo, BO_MAP_READ_WRITE, &map);
+	CHECK(addr != MAP_FAILED && bo_map_calls == 0);
+	CHECK(sync_count == 1 && sync_flags[0] == (DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW));
+	addr[0] = 0x5a;
+	CHECK(drv_bo_unmap(bo, map) == 0);
+	CHECK(sync_count == 2 && sync_flags[1] == (DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW));
+
+	/* A new mapping of the dma-buf sees what the last one wrote. */
+	drv_set_map_cache_limits(drv, 0, 0);
+	addr = map_bo(bo, BO_MAP_READ, &map);
+	CHECK(addr != MAP_FAILED && bo_map_calls == 0 && addr[0] == 0x5a);
+	CHECK(sync_count == 3 && sync_flags[2] == (DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ));
+	CHECK(drv_bo_unmap(bo, map) == 0);
+	CHECK(sync_count == 4 && sync_flags[3] == (DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ));
+
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+/* Dma-bufs that can't be mapped fall back to bo_map, and are still synced. */
+static int test_dma_buf_map_fallback(void)
+{
+	int fds[2];
+	uint8_t *addr;
+	struct map_info *map;
+	struct backend backend;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	use_dma_buf_backend(drv, &backend);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	/* Pipes can't be mapped. The record closes the read end when the handle is released. */
+	CHECK(atomic_load(&bo->records[0]->dma_buf_fd) < 0);
+	CHECK(pipe2(fds, O_CLOEXEC) == 0);
+	atomic_store(&bo->records[0]->dma_buf_fd, fds[0]);
+	close(fds[1]);
+
+	addr = map_bo(bo, BO_MAP_WRITE, &map);
+	CHECK(addr != MAP_FAILED && bo_map_calls == 1);
+	CHECK(sync_count == 1 && sync_flags[0] == (DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE));
+	addr[0] = 0x5a;
+	CHECK(drv_bo_unmap(bo, map) == 0);
+	CHECK(sync_count == 2 && sync_flags[1] == (DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE));
+
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+/* A failed import only closes the handles no other buffer holds. */
+static int test_close_unreferenced(void)
+{
+	struct bo imported;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	/* The import got the handle bo holds back for its first and last planes. */
+	memset(&imported, 0, sizeof(imported));
+	imported.drv = drv;
+	imported.num_planes = 3;
+	imported.handles[0].u32 = drv_bo_get_plane_handle(bo, 0).u32;
+	imported.handles[1].u32 = 0x7fff0000;
+	imported.handles[2].u32 = imported.handles[0].u32;
+
+	close_count = 0;
+	CHECK(drv_gem_bo_close_unreferenced(&imported, 3) == 0);
+	CHECK(close_count == 1 && closed_handles[0] == 0x7fff0000);
+
+	/* Planes the import never got to aren't closed. */
+	close_count = 0;
+	CHECK(drv_gem_bo_close_unreferenced(&imported, 1) == 0);
+	CHECK(close_count == 0);
+
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+/* Whole read-only mappings are read sequentially, unless the map cache will keep them. */
+static int test_sequential_reads(void)
+{
+	void *addr;
+	struct map_info *map;
+	struct driver *drv = drv_create(-1);
+	struct bo *bo;
+
+	CHECK(drv);
+	bo = create_bo(drv);
+	CHECK(bo);
+
+	addr = map_bo(bo, BO_MAP_READ, &map);
+	CHECK(addr != MAP_FAILED && read_sequentially(addr) == 1);
+	CHECK(drv_bo_unmap(bo, map) == 0);
+
+	drv_set_map_cache_limits(drv, 64 << 20, 0);
+	addr = map_bo(bo, BO_MAP_READ, &map);
+	CHECK(addr != MAP_FAILED && read_sequentially(addr) == 0);
+	CHECK(drv_bo_unmap(bo, map) == 0);
+
+	drv_bo_destroy(bo);
+	drv_destroy(drv);
+	return 0;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	RUN_TEST(test_cache_hit, failures);
+	RUN_TEST(test_cache_evict, failures);
+	RUN_TEST(test_cache_invalidate, failures);
+	RUN_TEST(test_read_and_write_slots, failures);
+	RUN_TEST(test_destroy_mapped, failures);
+	RUN_TEST(test_shadow_reuse, failures);
+	RUN_TEST(test_wait_idle, failures);
+	RUN_TEST(test_map_try, failures);
+	RUN_TEST(test_invalidate_skips_idle, failures);
+	RUN_TEST(test_dma_buf_map, failures);
+	RUN_TEST(test_dma_buf_map_fallback, failures);
+	RUN_TEST(test_close_unreferenced, failures);
+	RUN_TEST(test_sequential_reads, failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <pthread.h>
+
+#include "../drv_priv.h"
+#include "test.h"
+
+#define OBJECT_SIZE 48
+#define NUM_OBJECTS 8
+
+/* Returns how many objects of class are missing from the free list of drv. */
+static uint32_t objects_outside_free_list(struct driver *drv, uint32_t class)
+{
+	uint32_t count = 0;
+	void *p;
+
+	for (p = drv->objects.classes[class].slabs; p; p = *(void **)p)
+		count += DRV_OBJECTS_PER_SLAB;
+
+	for (p = drv->objects.classes[class].free_list; p; p = *(void **)p)
+		count--;
+
+	return count;
+}
+
+static void *alloc_and_free(void *arg)
+{
+	uint32_t i;
+	void *objects[NUM_OBJECTS];
+	struct driver *drv = arg;
+
+	for (i = 0; i < NUM_OBJECTS; i++)
+		objects[i] = drv_object_alloc(drv, OBJECT_SIZE);
+
+	for (i = 0; i < NUM_OBJECTS; i++)
+		drv_object_free(drv, objects[i], OBJECT_SIZE);
+
+	return NULL;
+}
+
+/* A thread that exits hands its cached objects back. */
+static int test_thread_exit(void)
+{
+	pthread_t thread;
+	struct driver *drv = drv_create(-1);
+
+	CHECK(drv);
+	CHECK(pthread_create(&thread, NULL, alloc_and_free, drv) == 0);
+	CHECK(pthread_join(thread, NULL) == 0);
+	CHECK(objects_outside_free_list(drv, 1) == 0);
+
+	drv_destroy(drv);
+	return 0;
+}
+
+struct switch_args {
+	struct driver *first;
+	struct driver *second;
+	pthread_barrier_t barrier;
+};
+
+static void *switch_drivers(void *arg)
+{
+	struct switch_args *args = arg;
+
+	alloc_and_free(args->first);
+	alloc_and_free(args->second);
+	pthread_barrier_wait(&args->barrier);
+
+	/* The main thread destroys the second driver while its objects are cached here. */
+	pthread_barrier_wait(&args->barrier);
+	alloc_and_free(args->first);
+	return NULL;
+}
+
+/* Switching drivers hands the objects back, and destroyed drivers drop their caches. */
+static int test_driver_switch(void)
+{
+	pthread_t thread;
+	struct switch_args args;
+
+	args.first = drv_create(-1);
+	args.second = drv_create(-1);
+	CHECK(args.first && args.second);
+	CHECK(pthread_barrier_init(&args.barrier, NULL, 2) == 0);
+	CHECK(pthread_create(&thread, NULL, switch_drivers, &args) == 0);
+
+	pthread_barrier_wait(&args.barrier);
+	CHECK(objects_outside_free_list(args.first, 1) == 0);
+	CHECK(objects_outside_free_list(args.second, 1) == NUM_OBJECTS);
+	CHECK(args.second->objects.caches);
+
+	drv_destroy(args.second);
+	pthread_barrier_wait(&args.barrier);
+	CHECK(pthread_join(thread, NULL) == 0);
+	CHECK(objects_outside_free_list(args.first, 1) == 0);
+
+	pthread_barrier_destroy(&args.barrier);
+	drv_destroy(args.first);
+	return 0;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	RUN_TEST(test_thread_exit, failures);
+	RUN_TEST(test_driver_switch, failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Compares lazy and prefaulted mappings of new sw buffers across buffer sizes, to place the
+ * default prefault size. Each round creates a buffer, maps it whole and goes over it once,
+ * writing or reading; the time covers the map and the pass, and the faults only the pass.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "../drv_priv.h"
+#include "test.h"
+
+#define ROUNDS 200
+
+static long minor_faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt;
+}
+
+static void bench(struct driver *drv, uint32_t height, uint32_t map_flags, double *ms,
+		  long *faults)
+{
+	uint32_t r;
+	size_t i;
+	long start_faults;
+	double start;
+	uint8_t *addr;
+	volatile uint64_t sum = 0;
+	struct map_info *map;
+	struct bo *bo;
+
+	*ms = 0;
+	*faults = 0;
+	for (r = 0; r < ROUNDS; r++) {
+		bo = drv_bo_create(drv, 1024, height, DRM_FORMAT_ARGB8888,
+				   BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN);
+		if (!bo)
+			return;
+
+		start = test_now_ns();
+		addr = drv_bo_map(bo, 0, 0, 1024, height, map_flags, &map, 0);
+		if (addr == MAP_FAILED) {
+			drv_bo_destroy(bo);
+			return;
+		}
+
+		start_faults = minor_faults();
+		if (map_flags & BO_MAP_WRITE) {
+			memset(addr, r, bo->total_size);
+		} else {
+			for (i = 0; i < bo->total_size; i += 64)
+				sum += addr[i];
+		}
+
+		*faults += minor_faults() - start_faults;
+		*ms += (test_now_ns() - start) / 1e6;
+
+		drv_bo_unmap(bo, map);
+		drv_bo_destroy(bo);
+	}
+
+	*ms /= ROUNDS;
+	*faults /= ROUNDS;
+}
+
+int main(void)
+{
+	size_t i, mode;
+	long faults[2];
+	double ms[2];
+	uint32_t map_flags;
+	struct driver *drv = drv_create(-1);
+	/* Rows of 4 KiB, for buffers of 8 KiB to 32 MiB. */
+	static const uint32_t heights[] = { 2, 4, 8, 16, 64, 256, 1024, 8192 };
+
+	if (!drv)
+		return 1;
+
+	for (map_flags = BO_MAP_READ; map_flags <= BO_MAP_WRITE; map_flags <<= 1) {
+		for (i = 0; i < sizeof(heights) / sizeof(heights[0]); i++) {
+			for (mode = 0; mode < 2; mode++) {
+				drv_set_map_prefault_size(drv, mode ? 0 : SIZE_MAX);
+				bench(drv, heights[i], map_flags, &ms[mode], &faults[mode]);
+			}
+
+			printf("%-5s %6u KiB: lazy %8.3f ms (%5ld faults), prefault %8.3f ms "
+			       "(%5ld faults)\n",
+			       map_flags & BO_MAP_WRITE ? "write" : "read", heights[i] * 4, ms[0],
+			       faults[0], ms[1], faults[1]);
+		}
+	}
+
+	drv_destroy(drv);
+	return 0;
+}
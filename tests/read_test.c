@@ -0,0 +1,160 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../gbm.h"
+#include "test.h"
+
+#define WIDTH 97
+#define HEIGHT 35
+/* Wider than any row read, to catch writes past the end of a row. */
+#define DST_STRIDE 512
+
+static uint8_t pattern(size_t plane, uint32_t x, uint32_t y)
+{
+	return (uint8_t)(plane * 101 + y * 7 + x);
+}
+
+/* Fills every plane of bo through a write mapping. */
+static int fill(struct gbm_bo *bo)
+{
+	size_t plane;
+	uint32_t x, y, stride, rows;
+	uint8_t *addr;
+	void *map_data;
+
+	for (plane = 0; plane < gbm_bo_get_num_planes(bo); plane++) {
+		addr = gbm_bo_map(bo, 0, 0, WIDTH, HEIGHT, GBM_BO_TRANSFER_WRITE, &stride,
+				  &map_data, plane);
+		CHECK(addr && addr != MAP_FAILED);
+		rows = gbm_bo_get_plane_size(bo, plane) / stride;
+		for (y = 0; y < rows; y++)
+			for (x = 0; x < stride; x++)
+				addr[y * stride + x] = pattern(plane, x, y);
+		gbm_bo_unmap(bo, map_data);
+	}
+
+	return 0;
+}
+
+/*
+ * Reads rect of plane and checks it against the pattern. Planes after the first have half as many
+ * rows and span the even pixels around rect, a byte each, as NV12's interleaved chroma does.
+ */
+static int check_read(struct gbm_bo *bo, size_t plane, uint32_t x, uint32_t y, uint32_t width,
+		      uint32_t height, uint32_t bytes_per_pixel)
+{
+	/* A spare row to catch writes past the last. */
+	static uint8_t dst[(HEIGHT + 1) * DST_STRIDE];
+	uint32_t row, col, x1 = x, x2 = x + width, y1 = y, y2 = y + height;
+
+	if (plane > 0) {
+		x1 &= ~1u;
+		x2 = (x2 + 1) & ~1u;
+		y1 /= 2;
+		y2 = (y2 + 1) / 2;
+	}
+
+	memset(dst, 0xee, sizeof(dst));
+	CHECK(gbm_bo_read(bo, x, y, width, height, dst, DST_STRIDE, plane) == 0);
+
+	for (row = 0; row < y2 - y1; row++) {
+		for (col = 0; col < (x2 - x1) * bytes_per_pixel; col++)
+			CHECK(dst[row * DST_STRIDE + col] ==
+			      pattern(plane, x1 * bytes_per_pixel + col, y1 + row));
+		CHECK(dst[row * DST_STRIDE + col] == 0xee);
+	}
+
+	CHECK(dst[row * DST_STRIDE] == 0xee);
+	return 0;
+}
+
+static int test_read_rgb(void)
+{
+	struct gbm_device *gbm = gbm_create_device(-1);
+	struct gbm_bo *bo;
+
+	CHECK(gbm);
+	bo = gbm_bo_create(gbm, WIDTH, HEIGHT, GBM_FORMAT_XRGB8888, GBM_BO_USE_RENDERING);
+	CHECK(bo);
+	CHECK(fill(bo) == 0);
+
+	CHECK(check_read(bo, 0, 0, 0, WIDTH, HEIGHT, 4) == 0);
+	CHECK(check_read(bo, 0, 13, 7, 31, 11, 4) == 0);
+	CHECK(check_read(bo, 0, WIDTH - 1, HEIGHT - 1, 1, 1, 4) == 0);
+
+	gbm_bo_destroy(bo);
+	gbm_device_destroy(gbm);
+	return 0;
+}
+
+static int test_read_nv12(void)
+{
+	struct gbm_device *gbm = gbm_create_device(-1);
+	struct gbm_bo *bo;
+
+	CHECK(gbm);
+	bo = gbm_bo_create(gbm, WIDTH, HEIGHT, GBM_FORMAT_NV12, GBM_BO_USE_TEXTURING);
+	CHECK(bo);
+	CHECK(gbm_bo_get_num_planes(bo) == 2);
+	CHECK(fill(bo) == 0);
+
+	CHECK(check_read(bo, 0, 0, 0, WIDTH, HEIGHT, 1) == 0);
+	CHECK(check_read(bo, 1, 0, 0, WIDTH, HEIGHT, 1) == 0);
+	/* Odd corners widen to the chroma samples covering them. */
+	CHECK(check_read(bo, 1, 13, 7, 30, 11, 1) == 0);
+	CHECK(check_read(bo, 1, WIDTH - 1, HEIGHT - 1, 1, 1, 1) == 0);
+
+	gbm_bo_destroy(bo);
+	gbm_device_destroy(gbm);
+	return 0;
+}
+
+/* Bad planes and rectangles are rejected without touching dst. */
+static int test_read_invalid(void)
+{
+	uint32_t i;
+	uint8_t dst[64];
+	struct gbm_device *gbm = gbm_create_device(-1);
+	struct gbm_bo *bo;
+
+	CHECK(gbm);
+	bo = gbm_bo_create(gbm, WIDTH, HEIGHT, GBM_FORMAT_XRGB8888, GBM_BO_USE_RENDERING);
+	CHECK(bo);
+
+	memset(dst, 0xee, sizeof(dst));
+	CHECK(gbm_bo_read(bo, 0, 0, 1, 1, dst, 4, 1) == -EINVAL);
+	CHECK(gbm_bo_read(bo, 0, 0, 0, 1, dst, 4, 0) == -EINVAL);
+	CHECK(gbm_bo_read(bo, 0, 0, 1, 0, dst, 4, 0) == -EINVAL);
+	CHECK(gbm_bo_read(bo, WIDTH, 0, 1, 1, dst, 4, 0) == -EINVAL);
+	CHECK(gbm_bo_read(bo, 0, HEIGHT, 1, 1, dst, 4, 0) == -EINVAL);
+	CHECK(gbm_bo_read(bo, 1, 0, WIDTH, 1, dst, 4, 0) == -EINVAL);
+	CHECK(gbm_bo_read(bo, 0, 1, 1, HEIGHT, dst, 4, 0) == -EINVAL);
+	/* x + width wraps around to within the buffer. */
+	CHECK(gbm_bo_read(bo, UINT32_MAX, 0, 2, 1, dst, 4, 0) == -EINVAL);
+	CHECK(gbm_bo_read(bo, 0, UINT32_MAX, 1, 2, dst, 4, 0) == -EINVAL);
+	for (i = 0; i < sizeof(dst); i++)
+		CHECK(dst[i] == 0xee);
+
+	gbm_bo_destroy(bo);
+	gbm_device_destroy(gbm);
+	return 0;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	RUN_TEST(test_read_rgb, failures);
+	RUN_TEST(test_read_nv12, failures);
+	RUN_TEST(test_read_invalid, failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../drv_priv.h"
+#include "test.h"
+
+#define WIDTH 97
+#define HEIGHT 35
+
+static uint8_t pattern(size_t plane, uint32_t x, uint32_t y)
+{
+	return (uint8_t)(plane * 101 + y * 7 + x);
+}
+
+/* Fills every plane of bo through a write mapping, returning the number of rows of each. */
+static int fill(struct bo *bo, uint32_t *rows)
+{
+	size_t plane;
+	uint32_t x, y, width, height;
+	uint8_t *addr;
+	struct map_info *map;
+
+	for (plane = 0; plane < drv_bo_get_num_planes(bo); plane++) {
+		width = drv_bo_get_plane_stride(bo, plane);
+		height = rows[plane] = drv_bo_get_plane_size(bo, plane) / width;
+		addr = drv_bo_map(bo, 0, 0, drv_bo_get_width(bo), drv_bo_get_height(bo),
+				  BO_MAP_WRITE, &map, plane);
+		CHECK(addr != MAP_FAILED);
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				addr[y * width + x] = pattern(plane, x, y);
+		CHECK(drv_bo_unmap(bo, map) == 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Checks the contents written by fill() through a read mapping. An imported plane may be larger,
+ * since the size of the last one comes from the size of the dma-buf.
+ */
+static int verify(struct bo *bo, const uint32_t *rows)
+{
+	size_t plane;
+	uint32_t x, y, width, height;
+	const uint8_t *addr;
+	struct map_info *map;
+
+	for (plane = 0; plane < drv_bo_get_num_planes(bo); plane++) {
+		width = drv_bo_get_plane_stride(bo, plane);
+		height = rows[plane];
+		CHECK(drv_bo_get_plane_size(bo, plane) >= height * width);
+		addr = drv_bo_map(bo, 0, 0, drv_bo_get_width(bo), drv_bo_get_height(bo),
+				  BO_MAP_READ, &map, plane);
+		CHECK(addr != MAP_FAILED);
+		for (y = 0; y < height; y++)
+			for (x = 0; x < width; x++)
+				CHECK(addr[y * width + x] == pattern(plane, x, y));
+		CHECK(drv_bo_unmap(bo, map) == 0);
+	}
+
+	return 0;
+}
+
+/* Creates a buffer, exports it, imports it into a second driver and reads it back there. */
+static int round_trip(uint32_t format, uint64_t use_flags)
+{
+	size_t plane;
+	int fds;
+	uint32_t rows[DRV_MAX_PLANES];
+	struct bo *bo, *imported;
+	struct drv_import_fd_data data;
+	struct driver *drv = drv_create(-1);
+	struct driver *other = drv_create(-1);
+
+	CHECK(drv && other);
+	CHECK(!strcmp(drv_get_name(drv), "sw"));
+	fds = test_count_fds();
+
+	bo = drv_bo_create(drv, WIDTH, HEIGHT, format, use_flags);
+	CHECK(bo);
+	CHECK(fill(bo, rows) == 0);
+
+	memset(&data, 0, sizeof(data));
+	data.width = WIDTH;
+	data.height = HEIGHT;
+	data.format = format;
+	data.use_flags = use_flags;
+	for (plane = 0; plane < drv_bo_get_num_planes(bo); plane++) {
+		data.fds[plane] = drv_bo_get_plane_fd(bo, plane);
+		CHECK(data.fds[plane] >= 0);
+		data.strides[plane] = drv_bo_get_plane_stride(bo, plane);
+		data.offsets[plane] = drv_bo_get_plane_offset(bo, plane);
+		CHECK(data.strides[plane] % 64 == 0);
+	}
+
+	imported = drv_bo_import(other, &data);
+	CHECK(imported);
+	for (plane = 0; plane < drv_bo_get_num_planes(bo); plane++)
+		close(data.fds[plane]);
+
+	/* The importer keeps the memory alive on its own. */
+	drv_bo_destroy(bo);
+	CHECK(drv_bo_get_num_planes(imported) == drv_num_planes_from_format(format));
+	CHECK(verify(imported, rows) == 0);
+	drv_bo_destroy(imported);
+
+	CHECK(test_count_fds() == fds);
+	drv_destroy(other);
+	drv_destroy(drv);
+	return 0;
+}
+
+static int test_round_trip_rgb(void)
+{
+	return round_trip(DRM_FORMAT_XRGB8888, BO_USE_RENDERING);
+}
+
+static int test_round_trip_nv12(void)
+{
+	return round_trip(DRM_FORMAT_NV12, BO_USE_TEXTURE);
+}
+
+/* Only a negative fd selects the sw backend; a file that isn't a DRM device is an error. */
+static int test_backend_selection(void)
+{
+	int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+	struct driver *drv;
+
+	CHECK(fd >= 0);
+	CHECK(!drv_create(fd));
+	close(fd);
+
+	drv = drv_create(-1);
+	CHECK(drv);
+	CHECK(!strcmp(drv_get_name(drv), "sw"));
+	drv_destroy(drv);
+	return 0;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	RUN_TEST(test_round_trip_rgb, failures);
+	RUN_TEST(test_round_trip_nv12, failures);
+	RUN_TEST(test_backend_selection, failures);
+
+	return failures ? 1 : 0;
+}
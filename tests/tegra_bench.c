@@ -0,0 +1,82 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times whole-buffer blocklinear transfers, the per-pixel routine against the sector-at-a-time
+ * one, on the calling thread. The backend is compiled into this file so the static transfers
+ * can be called.
+ */
+
+#include "../tegra.c"
+
+#include <stdlib.h>
+
+#include "test.h"
+#include "tegra_ref.h"
+
+#define ROUNDS 10
+
+static const char *type_names[] = { "read", "write" };
+
+static struct driver bench_driver;
+
+int main(void)
+{
+	size_t n, dirty_size;
+	uint32_t r;
+	enum tegra_map_type type;
+	double start, ref_ms, sector_ms;
+	struct bo bo;
+	struct tegra_private_map_data priv;
+	struct rectangle rect;
+	static const uint32_t sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+
+	drv_copy_engine_init(&bench_driver.copy_engine);
+	bench_driver.copy_engine.min_size = SIZE_MAX;
+
+	for (n = 0; n < ARRAY_SIZE(sizes); n++) {
+		memset(&bo, 0, sizeof(bo));
+		bo.drv = &bench_driver;
+		bo.format = DRM_FORMAT_ARGB8888;
+		bo.width = sizes[n][0];
+		bo.height = sizes[n][1];
+		tegra_bo_compute_layout(&bo, bo.width, bo.height, bo.format, BO_USE_RENDERING);
+		rect = (struct rectangle){ 0, 0, bo.width, bo.height };
+
+		priv.tiled = calloc(1, bo.total_size);
+		priv.untiled = calloc(1, bo.total_size);
+		dirty_size = tegra_dirty_size(&bo);
+		priv.dirty = malloc(dirty_size);
+		if (!priv.tiled || !priv.untiled || !priv.dirty)
+			return 1;
+
+		for (type = TEGRA_READ_TILED_BUFFER; type <= TEGRA_WRITE_TILED_BUFFER; type++) {
+			start = test_now_ns();
+			for (r = 0; r < ROUNDS; r++)
+				ref_transfer_tiled_memory(&bo, priv.tiled, priv.untiled, type);
+			ref_ms = (test_now_ns() - start) / 1e6 / ROUNDS;
+
+			start = test_now_ns();
+			for (r = 0; r < ROUNDS; r++) {
+				/* Reads skip dirty GOBs and writes only transfer them. */
+				memset(priv.dirty, (type == TEGRA_WRITE_TILED_BUFFER) ? 0xff : 0,
+				       dirty_size);
+				transfer_tiled_memory(&bo, &priv, &rect, BO_MAP_READ, type);
+			}
+			sector_ms = (test_now_ns() - start) / 1e6 / ROUNDS;
+
+			printf("%-5s %4ux%-4u: per pixel %7.2f ms, per sector %7.2f ms\n",
+			       type_names[type], bo.width, bo.height, ref_ms, sector_ms);
+		}
+
+		free(priv.tiled);
+		free(priv.untiled);
+		free(priv.dirty);
+	}
+
+	drv_copy_engine_fini(&bench_driver.copy_engine);
+	return 0;
+}
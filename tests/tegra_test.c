@@ -0,0 +1,299 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks the sector-at-a-time blocklinear transfers against the per-pixel routine they replaced,
+ * and mappings of one handle against each other. The backend is compiled into this file so the
+ * static functions can be called, with its GEM mmap ioctl answered by the test.
+ */
+
+#define drmCommandWriteRead test_drm_command_write_read
+#include "../tegra.c"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "tegra_ref.h"
+
+struct tegra_buffer {
+	struct bo bo;
+	struct tegra_private_map_data priv;
+	uint8_t *expected;
+};
+
+static struct driver test_driver;
+
+/* The driver fd is a memfd standing in for the GEM object, mapped from offset 0. */
+int test_drm_command_write_read(int fd, unsigned long index, void *data, unsigned long size)
+{
+	struct drm_tegra_gem_mmap *gem_map = data;
+
+	if (index != DRM_TEGRA_GEM_MMAP || size != sizeof(*gem_map))
+		return -EINVAL;
+
+	gem_map->offset = 0;
+	return 0;
+}
+
+static int buffer_init(struct tegra_buffer *buf, uint32_t width, uint32_t height)
+{
+	size_t i;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->bo.drv = &test_driver;
+	buf->bo.width = width;
+	buf->bo.height = height;
+	buf->bo.format = DRM_FORMAT_ARGB8888;
+	buf->bo.num_planes = 1;
+	tegra_bo_compute_layout(&buf->bo, width, height, buf->bo.format, BO_USE_RENDERING);
+
+	buf->priv.tiled = malloc(buf->bo.total_size);
+	buf->priv.untiled = calloc(1, buf->bo.total_size);
+	buf->priv.dirty = calloc(1, tegra_dirty_size(&buf->bo));
+	buf->expected = calloc(1, buf->bo.total_size);
+	if (!buf->priv.tiled || !buf->priv.untiled || !buf->priv.dirty || !buf->expected)
+		return 1;
+
+	for (i = 0; i < buf->bo.total_size; i++)
+		((uint8_t *)buf->priv.tiled)[i] = rand();
+
+	return 0;
+}
+
+static void buffer_fini(struct tegra_buffer *buf)
+{
+	free(buf->priv.tiled);
+	free(buf->priv.untiled);
+	free(buf->priv.dirty);
+	free(buf->expected);
+}
+
+static int rect_equal(struct tegra_buffer *buf, const uint8_t *a, const uint8_t *b,
+		      const struct rectangle *rect)
+{
+	uint32_t y;
+	uint32_t left = rect->x * 4, bytes = rect->width * 4;
+
+	for (y = rect->y; y < rect->y + rect->height; y++) {
+		size_t offset = (size_t)y * buf->bo.strides[0] + left;
+		if (memcmp(a + offset, b + offset, bytes))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void random_rect(struct bo *bo, struct rectangle *rect)
+{
+	rect->x = rand() % bo->width;
+	rect->y = rand() % bo->height;
+	rect->width = 1 + rand() % (bo->width - rect->x);
+	rect->height = 1 + rand() % (bo->height - rect->y);
+}
+
+/* Sizes cover a single GOB, partial GOBs at both edges and every block height. */
+static const uint32_t sizes[][2] = {
+	{ 1, 1 }, { 17, 5 }, { 64, 64 }, { 100, 37 }, { 333, 129 }, { 1920, 1080 },
+};
+
+static int test_read(void)
+{
+	size_t n;
+	struct tegra_buffer buf;
+	struct rectangle rect;
+
+	for (n = 0; n < ARRAY_SIZE(sizes); n++) {
+		CHECK(!buffer_init(&buf, sizes[n][0], sizes[n][1]));
+		ref_transfer_tiled_memory(&buf.bo, buf.priv.tiled, buf.expected,
+					  TEGRA_READ_TILED_BUFFER);
+
+		rect = (struct rectangle){ 0, 0, buf.bo.width, buf.bo.height };
+		transfer_tiled_memory(&buf.bo, &buf.priv, &rect, BO_MAP_READ,
+				      TEGRA_READ_TILED_BUFFER);
+		CHECK(rect_equal(&buf, buf.priv.untiled, buf.expected, &rect));
+		buffer_fini(&buf);
+	}
+
+	return 0;
+}
+
+static int test_read_region(void)
+{
+	size_t n;
+	uint32_t trial;
+	struct tegra_buffer buf;
+	struct rectangle rect;
+
+	for (n = 0; n < ARRAY_SIZE(sizes); n++) {
+		CHECK(!buffer_init(&buf, sizes[n][0], sizes[n][1]));
+		ref_transfer_tiled_memory(&buf.bo, buf.priv.tiled, buf.expected,
+					  TEGRA_READ_TILED_BUFFER);
+
+		for (trial = 0; trial < 8; trial++) {
+			random_rect(&buf.bo, &rect);
+			memset(buf.priv.untiled, 0, buf.bo.total_size);
+			transfer_tiled_memory(&buf.bo, &buf.priv, &rect, BO_MAP_READ,
+					      TEGRA_READ_TILED_BUFFER);
+			CHECK(rect_equal(&buf, buf.priv.untiled, buf.expected, &rect));
+		}
+
+		buffer_fini(&buf);
+	}
+
+	return 0;
+}
+
+/* Writes through a region must match the old routine retiling the whole modified buffer. */
+static int test_write_region(void)
+{
+	size_t n, i;
+	uint32_t trial, x, y;
+	uint8_t *untiled, *expected_tiled;
+	struct tegra_buffer buf;
+	struct rectangle rect;
+
+	for (n = 0; n < ARRAY_SIZE(sizes); n++) {
+		CHECK(!buffer_init(&buf, sizes[n][0], sizes[n][1]));
+		expected_tiled = malloc(buf.bo.total_size);
+		CHECK(expected_tiled);
+		memcpy(expected_tiled, buf.priv.tiled, buf.bo.total_size);
+		ref_transfer_tiled_memory(&buf.bo, buf.priv.tiled, buf.expected,
+					  TEGRA_READ_TILED_BUFFER);
+
+		for (trial = 0; trial < 8; trial++) {
+			random_rect(&buf.bo, &rect);
+			transfer_tiled_memory(&buf.bo, &buf.priv, &rect, BO_MAP_READ_WRITE,
+					      TEGRA_READ_TILED_BUFFER);
+
+			untiled = buf.priv.untiled;
+			for (y = rect.y; y < rect.y + rect.height; y++) {
+				for (x = rect.x * 4; x < (rect.x + rect.width) * 4; x++) {
+					i = (size_t)y * buf.bo.strides[0] + x;
+					untiled[i] ^= 0x5a;
+					buf.expected[i] ^= 0x5a;
+				}
+			}
+
+			transfer_tiled_memory(&buf.bo, &buf.priv, &rect, BO_MAP_READ_WRITE,
+					      TEGRA_WRITE_TILED_BUFFER);
+			ref_transfer_tiled_memory(&buf.bo, expected_tiled, buf.expected,
+						  TEGRA_WRITE_TILED_BUFFER);
+			CHECK(!memcmp(buf.priv.tiled, expected_tiled, buf.bo.total_size));
+		}
+
+		/* Every GOB the writes marked dirty was flushed. */
+		for (i = 0; i < tegra_dirty_size(&buf.bo) / sizeof(*buf.priv.dirty); i++)
+			CHECK(!buf.priv.dirty[i]);
+
+		free(expected_tiled);
+		buffer_fini(&buf);
+	}
+
+	return 0;
+}
+
+/* Reads after a write to the same GOBs keep the untiled bytes written since. */
+static int test_read_keeps_dirty(void)
+{
+	struct tegra_buffer buf;
+	struct rectangle rect = { 0, 0, 16, 8 };
+	uint8_t *untiled;
+
+	CHECK(!buffer_init(&buf, 64, 64));
+	transfer_tiled_memory(&buf.bo, &buf.priv, &rect, BO_MAP_READ_WRITE,
+			      TEGRA_READ_TILED_BUFFER);
+
+	untiled = buf.priv.untiled;
+	untiled[0] ^= 0xff;
+	memcpy(buf.expected, untiled, buf.bo.total_size);
+
+	transfer_tiled_memory(&buf.bo, &buf.priv, &rect, BO_MAP_READ_WRITE,
+			      TEGRA_READ_TILED_BUFFER);
+	CHECK(rect_equal(&buf, buf.priv.untiled, buf.expected, &rect));
+
+	buffer_fini(&buf);
+	return 0;
+}
+
+/*
+ * A mapping that loses a race in drv_bo_map() is made and unmapped while the winner is in use. The
+ * winner's writes must still reach the buffer.
+ */
+static int test_overlapping_maps(void)
+{
+	size_t i;
+	uint8_t *untiled, *tiled, *expected_tiled;
+	struct tegra_buffer buf;
+	struct handle_record record;
+	struct map_info winner, loser;
+	struct rectangle rect;
+	uint32_t slot;
+
+	CHECK(!buffer_init(&buf, 100, 37));
+	memset(&record, 0, sizeof(record));
+	buf.bo.records[0] = &record;
+
+	test_driver.fd = memfd_create("tegra_test", MFD_CLOEXEC);
+	CHECK(test_driver.fd >= 0);
+	CHECK(pwrite(test_driver.fd, buf.priv.tiled, buf.bo.total_size, 0) ==
+	      (ssize_t)buf.bo.total_size);
+
+	memset(&winner, 0, sizeof(winner));
+	winner.map_flags = BO_MAP_READ_WRITE;
+	loser = winner;
+	rect = (struct rectangle){ 0, 0, buf.bo.width, buf.bo.height };
+
+	untiled = tegra_bo_map(&buf.bo, &winner, 0, winner.map_flags);
+	CHECK(untiled != MAP_FAILED);
+	CHECK(tegra_bo_invalidate(&buf.bo, &winner, &rect) == 0);
+	for (i = 0; i < buf.bo.strides[0]; i++)
+		untiled[i] ^= 0x5a;
+
+	CHECK(tegra_bo_map(&buf.bo, &loser, 0, loser.map_flags) == untiled);
+	CHECK(tegra_bo_unmap(&buf.bo, &loser) == 0);
+
+	/* The old routine retiles the same writes. */
+	expected_tiled = buf.priv.tiled;
+	ref_transfer_tiled_memory(&buf.bo, expected_tiled, buf.expected, TEGRA_READ_TILED_BUFFER);
+	for (i = 0; i < buf.bo.strides[0]; i++)
+		buf.expected[i] ^= 0x5a;
+	ref_transfer_tiled_memory(&buf.bo, expected_tiled, buf.expected, TEGRA_WRITE_TILED_BUFFER);
+
+	CHECK(tegra_bo_flush(&buf.bo, &winner, &rect) == 0);
+	tiled = ((struct tegra_private_map_data *)winner.priv)->tiled;
+	CHECK(!memcmp(tiled, expected_tiled, buf.bo.total_size));
+	CHECK(tegra_bo_unmap(&buf.bo, &winner) == 0);
+
+	for (slot = 0; slot < DRV_MAP_SLOTS; slot++)
+		free(atomic_load(&record.shadows[slot]));
+
+	close(test_driver.fd);
+	buffer_fini(&buf);
+	return 0;
+}
+
+int main(void)
+{
+	int pass, failures = 0;
+
+	drv_copy_engine_init(&test_driver.copy_engine);
+
+	/* Once on the calling thread, once split across the copy engine. */
+	for (pass = 0; pass < 2; pass++) {
+		test_driver.copy_engine.min_size = pass ? 0 : SIZE_MAX;
+		RUN_TEST(test_read, failures);
+		RUN_TEST(test_read_region, failures);
+		RUN_TEST(test_write_region, failures);
+		RUN_TEST(test_read_keeps_dirty, failures);
+	}
+
+	RUN_TEST(test_overlapping_maps, failures);
+
+	drv_copy_engine_fini(&test_driver.copy_engine);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2018 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <dirent.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Minimal helpers for the host tests. They run against the sw backend, so no GPU is needed.
+ * A test is a function returning 0 on success; CHECK() reports the first failure and returns 1.
+ */
+
+#define CHECK(cond)                                                                                \
+	do {                                                                                       \
+		if (!(cond)) {                                                                     \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+			return 1;                                                                  \
+		}                                                                                  \
+	} while (0)
+
+#define RUN_TEST(test, failures)                                                                   \
+	do {                                                                                       \
+		int _ret = test();                                                                 \
+		printf("%s: %s\n", #test, _ret ? "FAIL" : "ok");                                   \
+		failures += _ret;                                                                  \
+	} while (0)
+
+/* Returns the number of open file descriptors, used to catch leaked buffers. */
+static inline int test_count_fds(void)
+{
+	int count = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/fd");
+	if (!dir)
+		return -1;
+
+	while (readdir(dir))
+		count++;
+
+	closedir(dir);
+	return count;
+}
+
+/* Returns a monotonic timestamp in nanoseconds, for the benchmarks. */
+static inline double test_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#endif
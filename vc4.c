@@ -30,13 +30,10 @@ static int vc4_init(struct driver *drv)
 	return drv_modify_linear_combinations(drv);
 }
 
-static int vc4_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
-			 uint64_t use_flags)
+static int vc4_bo_compute_layout(struct bo *bo, uint32_t width, uint32_t height,
+				 uint32_t format, uint64_t use_flags)
 {
-	int ret;
-	size_t plane;
 	uint32_t stride;
-	struct drm_vc4_create_bo bo_create;
 
 	/*
 	 * Since the ARM L1 cache line size is 64 bytes, align to that as a
@@ -46,6 +43,15 @@ static int vc4_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_
 	stride = ALIGN(stride, 64);
 	drv_bo_from_format(bo, stride, height, format);
 
+	return 0;
+}
+
+static int vc4_bo_create_from_layout(struct bo *bo)
+{
+	int ret;
+	size_t plane;
+	struct drm_vc4_create_bo bo_create;
+
 	memset(&bo_create, 0, sizeof(bo_create));
 	bo_create.size = bo->total_size;
 
@@ -62,6 +68,18 @@ static int vc4_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_
 	return 0;
 }
 
+static int vc4_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
+			 uint64_t use_flags)
+{
+	int ret;
+
+	ret = vc4_bo_compute_layout(bo, width, height, format, use_flags);
+	if (ret)
+		return ret;
+
+	return vc4_bo_create_from_layout(bo);
+}
+
 static void *vc4_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -83,8 +101,11 @@ static void *vc4_bo_map(struct bo *bo, struct map_info *data, size_t plane, uint
 
 struct backend backend_vc4 = {
 	.name = "vc4",
+	.flags = BACKEND_MAP_DMA_BUF,
 	.init = vc4_init,
 	.bo_create = vc4_bo_create,
+	.bo_compute_layout = vc4_bo_compute_layout,
+	.bo_create_from_layout = vc4_bo_create_from_layout,
 	.bo_import = drv_prime_bo_import,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_map = vc4_bo_map,
@@ -62,11 +62,14 @@ static uint32_t vgem_resolve_format(uint32_t format, uint64_t flags)
 
 struct backend backend_vgem = {
 	.name = "vgem",
+	.flags = BACKEND_MAP_DMA_BUF | BACKEND_INVALIDATE_SKIP_IDLE,
 	.init = vgem_init,
 	.bo_create = vgem_bo_create,
 	.bo_destroy = drv_dumb_bo_destroy,
 	.bo_import = drv_prime_bo_import,
 	.bo_map = drv_dumb_bo_map,
 	.bo_unmap = drv_bo_munmap,
+	.bo_invalidate = drv_dma_buf_invalidate,
+	.bo_flush = drv_dma_buf_flush,
 	.resolve_format = vgem_resolve_format,
 };